@@ -0,0 +1,50 @@
+// copyright defined in LICENSE.txt
+
+// usage: node bench-client.js [url] [num-requests] [concurrency]
+
+const fetch = require('node-fetch');
+
+const url = process.argv[2] || 'http://127.0.0.1:8880';
+const numRequests = +(process.argv[3] || 10000);
+const concurrency = +(process.argv[4] || 16);
+
+const requests = [
+    ['/v1/chain/get_table_rows', { code: 'eosio', scope: 'eosio', table: 'namebids', show_payer: true, json: true, key_type: 'name', index_position: '2', limit: 100 }],
+    ['/v1/chain/get_table_rows', { code: 'eosio', scope: 'eosio', table: 'global', json: true, limit: 10 }],
+    ['/v1/chain/get_abi', { account_name: 'eosio' }],
+    ['/v1/chain/get_account', { account_name: 'eosio' }],
+    ['/v1/chain/get_currency_balance', { code: 'eosio.token', account: 'eosio', symbol: 'EOS' }],
+];
+
+async function run() {
+    const latencies = [];
+    let next = 0;
+    let failed = 0;
+
+    async function worker() {
+        while (next < numRequests) {
+            const [target, body] = requests[next++ % requests.length];
+            const begin = process.hrtime.bigint();
+            const reply = await fetch(url + target, { method: 'POST', body: JSON.stringify(body) });
+            await reply.arrayBuffer();
+            if (reply.status !== 200)
+                ++failed;
+            latencies.push(Number(process.hrtime.bigint() - begin) / 1e6);
+        }
+    }
+
+    const begin = process.hrtime.bigint();
+    await Promise.all(Array.from({ length: concurrency }, worker));
+    const seconds = Number(process.hrtime.bigint() - begin) / 1e9;
+
+    latencies.sort((a, b) => a - b);
+    const percentile = p => latencies[Math.min(latencies.length - 1, Math.floor(latencies.length * p))].toFixed(2);
+    console.log(`requests:    ${latencies.length} (${failed} failed)`);
+    console.log(`requests/s:  ${(latencies.length / seconds).toFixed(0)}`);
+    console.log(`latency ms:  p50 ${percentile(.5)}  p90 ${percentile(.9)}  p99 ${percentile(.99)}  max ${percentile(1)}`);
+}
+
+run().catch(e => {
+    console.error(e);
+    process.exit(1);
+});
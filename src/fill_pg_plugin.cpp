@@ -12,7 +12,11 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <deque>
 #include <fc/exception/exception.hpp>
+#include <future>
 #include <vector>
 
 #include <pqxx/tablewriter>
@@ -41,22 +45,117 @@ struct table_stream {
         , writer(t, name) {}
 };
 
+// COPY ... with (format binary). tablewriter only writes text lines, so this talks to libpq directly.
+struct copy_stream {
+    pg_conn_ptr c;
+    std::string buffer = copy_header;
+
+    copy_stream(const std::string& name)
+        : c(PQconnectdb("")) {
+        if (PQstatus(c.get()) != CONNECTION_OK)
+            throw std::runtime_error(PQerrorMessage(c.get()));
+        pg_result_ptr r{PQexec(c.get(), ("copy " + name + " from stdin with (format binary)").c_str())};
+        if (PQresultStatus(r.get()) != PGRES_COPY_IN)
+            throw std::runtime_error("copy " + name + ": " + PQerrorMessage(c.get()));
+    }
+
+    void write_row(const std::string& row) {
+        buffer += row;
+        if (buffer.size() >= 1024 * 1024)
+            flush();
+    }
+
+    void flush() {
+        if (!buffer.empty() && PQputCopyData(c.get(), buffer.data(), buffer.size()) != 1)
+            throw std::runtime_error(PQerrorMessage(c.get()));
+        buffer.clear();
+    }
+
+    void complete() {
+        push_be(buffer, int16_t(-1));
+        flush();
+        if (PQputCopyEnd(c.get(), nullptr) != 1)
+            throw std::runtime_error(PQerrorMessage(c.get()));
+        while (true) {
+            pg_result_ptr r{PQgetResult(c.get())};
+            if (!r)
+                break;
+            if (PQresultStatus(r.get()) != PGRES_COMMAND_OK)
+                throw std::runtime_error(PQresultErrorMessage(r.get()));
+        }
+    }
+};
+
+// Fields of a binary COPY row, or of a binary composite value. Composite fields are preceded by their type oid.
+struct binary_fields {
+    std::string& dest;
+    bool         composite;
+    size_t       count_pos;
+    int32_t      count = 0;
+
+    binary_fields(std::string& dest, bool composite)
+        : dest(dest)
+        , composite(composite)
+        , count_pos(dest.size()) {
+        dest.append(composite ? 4 : 2, '\0');
+    }
+
+    template <typename F>
+    void add(uint32_t oid, F f) {
+        if (composite)
+            push_be(dest, oid);
+        push_value(dest, f);
+        ++count;
+    }
+
+    template <typename T>
+    void native(const T& v) {
+        add(0, [&](std::string& d) { return native_to_param(d, v); });
+    }
+
+    void finish() {
+        int size = composite ? 4 : 2;
+        for (int i = 0; i < size; ++i)
+            dest[count_pos + i] = char(uint32_t(count) >> ((size - 1 - i) * 8));
+    }
+};
+
+// Binary COPY rows of one block. fpg_session::encode fills these, on a worker thread when fpg-threads is set;
+// apply_block then writes them on the io thread in block order, since token detection depends on earlier blocks.
+struct encoded_block {
+    uint32_t                                          block_num = 0;
+    checksum256                                       block_id  = {};
+    std::shared_ptr<flat_buffer>                      message;      // owns the data block, deltas and traces point into
+    std::optional<input_buffer>                       block;
+    std::optional<input_buffer>                       deltas;
+    std::optional<input_buffer>                       traces;
+    std::map<std::string, std::string>                rows;         // table -> rows
+    uint64_t                                          num_rows = 0;
+    std::vector<row>                                  contract_table_rows;
+    std::vector<std::pair<abieos::name, std::string>> action_traces; // account, row; also copied to token_action_trace
+    std::promise<void>                                done;
+    std::future<void>                                 ready = done.get_future();
+};
+
 struct fpg_session;
 
 struct fill_postgresql_config : connection_config {
     std::string             schema;
-    uint32_t                skip_to       = 0;
-    uint32_t                stop_before   = 0;
-    std::vector<trx_filter> trx_filters   = {};
-    bool                    drop_schema   = false;
-    bool                    create_schema = false;
-    bool                    enable_trim   = false;
+    uint32_t                skip_to        = 0;
+    uint32_t                stop_before    = 0;
+    std::vector<trx_filter> trx_filters    = {};
+    bool                    drop_schema    = false;
+    bool                    create_schema  = false;
+    bool                    enable_trim    = false;
+    bool                    binary_copy    = false;
+    uint32_t                encode_threads = 0;
 };
 
 struct fill_postgresql_plugin_impl : std::enable_shared_from_this<fill_postgresql_plugin_impl> {
     std::shared_ptr<fill_postgresql_config> config = std::make_shared<fill_postgresql_config>();
     std::shared_ptr<fpg_session>            session;
     boost::asio::deadline_timer             timer;
+    std::unique_ptr<asio::thread_pool>      workers;
 
     fill_postgresql_plugin_impl()
         : timer(app().get_io_service()) {}
@@ -87,7 +186,12 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
     uint32_t                                             first           = 0;
     uint32_t                                             first_bulk      = 0;
     std::map<std::string, std::unique_ptr<table_stream>> table_streams;
+    std::map<std::string, std::unique_ptr<copy_stream>>  copy_streams;
+    std::map<std::string, uint32_t>                      type_oids;
+    uint64_t                                             bulk_rows = 0;
+    std::chrono::steady_clock::time_point                bulk_start;
     std::vector<std::string>                             token_codes;
+    std::deque<std::shared_ptr<encoded_block>>           encoding;
 
     fpg_session(fill_postgresql_plugin_impl* my)
         : my(my)
@@ -445,6 +549,7 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
             query += "irreversible=" + std::to_string(head) + ", irreversible_id=" + quote(head_id);
         query += ", first=" + std::to_string(first);
         pipeline.insert(query);
+        pipeline.insert("notify " + t.quote_name(fill_status_channel(config->schema)));
     }
 
     void truncate(pqxx::work& t, pqxx::pipeline& pipeline, uint32_t block) {
@@ -491,6 +596,23 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         res.push_back (s.substr (pos_start));
         return res;
     }
+
+    bool is_token_code(abieos::name account) {
+        return std::find(token_codes.begin(), token_codes.end(), std::string(account)) != token_codes.end();
+    }
+
+    // values is the bulk (text) form of a contract_table row
+    void check_token_code(uint32_t block_num, pqxx::work& t, pqxx::pipeline& pipeline, const std::string& values) {
+        if (std::string::npos == values.find("stat"))
+            return;
+        std::vector<std::string> talbe_values = split_word (values, "\t");
+        if(talbe_values.size() == 6 && std::find(token_codes.begin(), token_codes.end(), talbe_values[2]) == token_codes.end()){
+            token_codes.push_back(talbe_values[2]);
+            std::string table_value = "'" + talbe_values[2] + "'";
+            write(block_num, t, pipeline, false, "token_account", "code", table_value);
+        }
+    }
+
     bool received(get_blocks_result_v0& result) override {
         if (!result.this_block)
             return true;
@@ -516,7 +638,7 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
 
         if (!bulk || large_deltas || !(result.this_block->block_num % 200))
             close_streams();
-        if (table_streams.empty())
+        if (table_streams.empty() && copy_streams.empty() && encoding.empty())
             trim();
         if (!bulk)
             ilog("block ${b}", ("b", result.this_block->block_num));
@@ -527,12 +649,16 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
             truncate(t, pipeline, result.this_block->block_num);
         if (!head_id.empty() && (!result.prev_block || (std::string)result.prev_block->block_id != head_id))
             throw std::runtime_error("prev_block does not match");
-        if (result.block)
-            receive_block(result.this_block->block_num, result.this_block->block_id, *result.block, bulk, t, pipeline);
-        if (result.deltas)
-            receive_deltas(result.this_block->block_num, *result.deltas, bulk, t, pipeline);
-        if (result.traces)
-            receive_traces(result.this_block->block_num, *result.traces, bulk, t, pipeline);
+        if (bulk && config->binary_copy) {
+            queue_block(result, t, pipeline);
+        } else {
+            if (result.block)
+                receive_block(result.this_block->block_num, result.this_block->block_id, *result.block, bulk, t, pipeline);
+            if (result.deltas)
+                receive_deltas(result.this_block->block_num, *result.deltas, bulk, t, pipeline);
+            if (result.traces)
+                receive_traces(result.this_block->block_num, *result.traces, bulk, t, pipeline);
+        }
 
         head            = result.this_block->block_num;
         head_id         = (std::string)result.this_block->block_id;
@@ -553,17 +679,125 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         return true;
     } // receive_result()
 
+    void start_bulk(uint32_t block_num) {
+        if (first_bulk)
+            return;
+        first_bulk = block_num;
+        bulk_rows  = 0;
+        bulk_start = std::chrono::steady_clock::now();
+    }
+
     void write_stream(uint32_t block_num, pqxx::work& t, const std::string& name, const std::string& values) {
-        if (!first_bulk)
-            first_bulk = block_num;
+        start_bulk(block_num);
         auto& ts = table_streams[name];
         if (!ts)
             ts = std::make_unique<table_stream>(t.quote_name(config->schema) + "." + t.quote_name(name));
         ts->writer.write_raw_line(values);
+        ++bulk_rows;
+    }
+
+    void write_copy(uint32_t block_num, const std::string& name, const std::string& rows) {
+        start_bulk(block_num);
+        auto& cs = copy_streams[name];
+        if (!cs)
+            cs = std::make_unique<copy_stream>(sql_connection->quote_name(config->schema) + "." + sql_connection->quote_name(name));
+        cs->write_row(rows);
+    }
+
+    // Encodes the block, on the worker pool if there is one, and writes encoded blocks to the copy streams in order.
+    // At most 2 * fpg-threads blocks are in flight; beyond that the io thread waits, which also stops reading from nodeos.
+    void queue_block(get_blocks_result_v0& result, pqxx::work& t, pqxx::pipeline& pipeline) {
+        if (type_oids.empty())
+            load_type_oids(); // workers only read type_oids
+        auto b       = std::make_shared<encoded_block>();
+        b->block_num = result.this_block->block_num;
+        b->block_id  = result.this_block->block_id;
+        b->message   = connection->message;
+        b->block     = result.block;
+        b->deltas    = result.deltas;
+        b->traces    = result.traces;
+
+        if (!my || !my->workers) {
+            encode(*b);
+            apply_block(*b, t, pipeline);
+            return;
+        }
+        asio::post(*my->workers, [self = shared_from_this(), b] {
+            try {
+                self->encode(*b);
+                b->done.set_value();
+            } catch (...) {
+                b->done.set_exception(std::current_exception());
+            }
+        });
+        encoding.push_back(b);
+        while (!encoding.empty() && (encoding.size() > 2 * config->encode_threads ||
+                                     encoding.front()->ready.wait_for(0s) == std::future_status::ready))
+            apply_next(t, pipeline);
+    }
+
+    void apply_next(pqxx::work& t, pqxx::pipeline& pipeline) {
+        auto b = std::move(encoding.front());
+        encoding.pop_front();
+        b->ready.get();
+        apply_block(*b, t, pipeline);
+    }
+
+    void apply_block(encoded_block& b, pqxx::work& t, pqxx::pipeline& pipeline) {
+        if (!b.contract_table_rows.empty()) {
+            auto& type = *get_type("contract_table").fields[0].type;
+            for (auto& row : b.contract_table_rows) {
+                std::string fields;
+                std::string values = std::to_string(b.block_num) + sep(true) + sql_str(true, row.present);
+                for (auto& field : type.fields)
+                    fill_value(true, false, t, "", fields, values, row.data, field);
+                check_token_code(b.block_num, t, pipeline, values);
+            }
+        }
+        for (auto& [name, rows] : b.rows)
+            write_copy(b.block_num, name, rows);
+        for (auto& [account, row] : b.action_traces) {
+            write_copy(b.block_num, "action_trace", row);
+            if (is_token_code(account)) {
+                write_copy(b.block_num, "token_action_trace", row);
+                ++bulk_rows;
+            }
+        }
+        bulk_rows += b.num_rows;
+    }
+
+    void load_type_oids() {
+        pqxx::work t(*sql_connection);
+        auto       rows = t.exec(
+            "select typname, oid from pg_type where typnamespace = (select oid from pg_namespace where nspname = " +
+            t.quote(config->schema) + ")");
+        for (auto row : rows)
+            type_oids[row[0].as<std::string>()] = row[1].as<uint32_t>();
+        t.commit();
+    }
+
+    // oids of types created in the schema are needed inside binary arrays and composites
+    uint32_t get_oid(const std::string& sql_type) {
+        if (auto oid = builtin_oid(sql_type))
+            return oid;
+        if (type_oids.empty())
+            load_type_oids();
+        auto it = type_oids.find(sql_type);
+        if (it == type_oids.end())
+            throw std::runtime_error("unknown type: " + sql_type);
+        return it->second;
     }
 
     void close_streams() {
-        if (table_streams.empty())
+        if (!encoding.empty()) {
+            pqxx::work     t(*sql_connection);
+            pqxx::pipeline pipeline(t);
+            while (!encoding.empty())
+                apply_next(t, pipeline);
+            pipeline.complete();
+            t.commit();
+        }
+        if (table_streams.empty() && copy_streams.empty())
             return;
         for (auto& [_, ts] : table_streams) {
             ts->writer.complete();
@@ -571,6 +805,9 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
             ts.reset();
         }
         table_streams.clear();
+        for (auto& [_, cs] : copy_streams)
+            cs->complete();
+        copy_streams.clear();
 
         pqxx::work     t(*sql_connection);
         pqxx::pipeline pipeline(t);
@@ -578,7 +815,10 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         pipeline.complete();
         t.commit();
 
-        ilog("block ${b} - ${e}", ("b", first_bulk)("e", head));
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bulk_start).count();
+        ilog(
+            "block ${b} - ${e}: ${r} rows, ${rs} rows/s",
+            ("b", first_bulk)("e", head)("r", bulk_rows)("rs", us ? bulk_rows * 1'000'000 / us : 0));
         first_bulk = 0;
     }
 
@@ -685,6 +925,224 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         }
     } // fill_value
 
+    // Binary counterpart of fill_value
+    void fill_binary(binary_fields& fields, input_buffer& bin, const abi_field& field) {
+        if (field.type->filled_struct) {
+            for (auto& f : field.type->fields)
+                fill_binary(fields, bin, f);
+        } else if (field.type->optional_of && field.type->optional_of->filled_struct) {
+            auto present = read_raw<bool>(bin);
+            fields.add(builtin_oid("bool"), [&](std::string& d) { return native_to_param(d, present); });
+            if (present) {
+                for (auto& f : field.type->optional_of->fields)
+                    fill_binary(fields, bin, f);
+            } else {
+                for (auto& f : field.type->optional_of->fields) {
+                    auto it = abi_type_to_sql_type.find(f.type->name);
+                    if (it == abi_type_to_sql_type.end())
+                        throw std::runtime_error("don't know sql type for abi type: " + f.type->name);
+                    if (!it->second.empty_to_param)
+                        throw std::runtime_error("don't know how to process empty " + field.type->name);
+                    fields.add(get_oid(it->second.name), [&](std::string& d) { return it->second.empty_to_param(d); });
+                }
+            }
+        } else if (field.type->filled_variant && field.type->fields.size() == 1 && field.type->fields[0].type->filled_struct) {
+            auto v = read_varuint32(bin);
+            if (v)
+                throw std::runtime_error("invalid variant in " + field.type->name);
+            for (auto& f : field.type->fields[0].type->fields)
+                fill_binary(fields, bin, f);
+        } else if (field.type->array_of && field.type->array_of->filled_struct) {
+            fill_binary_array(fields, bin, *field.type->array_of, false);
+        } else if (field.type->array_of && field.type->array_of->filled_variant && field.type->array_of->fields[0].type->filled_struct) {
+            fill_binary_array(fields, bin, *field.type->array_of->fields[0].type, true);
+        } else {
+            auto abi_type    = field.type->name;
+            bool is_optional = false;
+            if (abi_type.size() >= 1 && abi_type.back() == '?') {
+                is_optional = true;
+                abi_type.resize(abi_type.size() - 1);
+            }
+            auto it = abi_type_to_sql_type.find(abi_type);
+            if (it == abi_type_to_sql_type.end())
+                throw std::runtime_error("don't know sql type for abi type: " + abi_type);
+            if (!it->second.bin_to_param)
+                throw std::runtime_error("don't know how to process " + field.type->name);
+            fields.add(get_oid(it->second.name), [&](std::string& d) { //
+                return (!is_optional || read_raw<bool>(bin)) && it->second.bin_to_param(d, bin);
+            });
+        }
+    } // fill_binary
+
+    void fill_binary_array(binary_fields& fields, input_buffer& bin, const abi_type& element, bool is_variant) {
+        auto element_oid = get_oid(element.name);
+        fields.add(get_oid("_" + element.name), [&](std::string& array) {
+            push_array(array, element_oid, [&](std::string& elements) {
+                uint32_t n = read_varuint32(bin);
+                for (uint32_t i = 0; i < n; ++i) {
+                    if (is_variant && read_varuint32(bin) != 0)
+                        throw std::runtime_error("expected 0 variant index");
+                    push_value(elements, [&](std::string& obj) {
+                        binary_fields struct_fields{obj, true};
+                        for (auto& f : element.fields)
+                            fill_binary(struct_fields, bin, f);
+                        struct_fields.finish();
+                        return true;
+                    });
+                }
+                return n;
+            });
+            return true;
+        });
+    }
+
+    // Binary counterparts of receive_block, receive_deltas and receive_traces. These may run on worker threads, so they only
+    // read session state; token detection is left to apply_block.
+    void encode(encoded_block& b) {
+        if (b.block)
+            encode_block(b, *b.block);
+        if (b.deltas)
+            encode_deltas(b, *b.deltas);
+        if (b.traces)
+            encode_traces(b, *b.traces);
+    }
+
+    void encode_block(encoded_block& b, input_buffer bin) {
+        signed_block block;
+        bin_to_native(block, bin);
+
+        binary_fields fields{b.rows["block_info"], false};
+        fields.native(b.block_num);
+        fields.native(b.block_id);
+        fields.native(block.timestamp);
+        fields.native(block.producer);
+        fields.native(block.confirmed);
+        fields.native(block.previous);
+        fields.native(block.transaction_mroot);
+        fields.native(block.action_mroot);
+        fields.native(block.schedule_version);
+        fields.native(block.new_producers ? block.new_producers->version : 0u);
+        fields.finish();
+        ++b.num_rows;
+    }
+
+    void encode_deltas(encoded_block& b, input_buffer bin) {
+        auto num = read_varuint32(bin);
+        for (uint32_t i = 0; i < num; ++i) {
+            auto table_delta = read_table_delta(bin, get_type("table_delta"));
+            auto name        = std::string(table_delta.name);
+            if (name == "global_property")
+                continue;
+
+            auto& variant_type = get_type(name);
+            if (!variant_type.filled_variant || variant_type.fields.size() != 1 || !variant_type.fields[0].type->filled_struct)
+                throw std::runtime_error("don't know how to proccess " + variant_type.name);
+            auto& type = *variant_type.fields[0].type;
+            auto& dest = b.rows[name];
+
+            size_t num_processed = 0;
+            table_delta.for_each_row([&](auto& row) {
+                if (table_delta.num_rows > 10000 && !(num_processed % 10000))
+                    ilog("block ${b} ${t} ${n} of ${r}", ("b", b.block_num)("t", name)("n", num_processed)("r", table_delta.num_rows));
+                check_variant(row.data, variant_type, 0u);
+                if (name == "contract_table")
+                    b.contract_table_rows.push_back(row);
+                binary_fields fields{dest, false};
+                fields.native(b.block_num);
+                fields.native(row.present);
+                for (auto& field : type.fields)
+                    fill_binary(fields, row.data, field);
+                fields.finish();
+                ++num_processed;
+            });
+            b.num_rows += table_delta.num_rows;
+        }
+    } // encode_deltas
+
+    void encode_traces(encoded_block& b, input_buffer bin) {
+        auto     num          = read_varuint32(bin);
+        uint32_t num_ordinals = 0;
+        for (uint32_t i = 0; i < num; ++i) {
+            transaction_trace trace;
+            bin_to_native(trace, bin);
+            if (filter(config->trx_filters, std::get<0>(trace)))
+                encode_transaction_trace(b, num_ordinals, std::get<transaction_trace_v0>(trace));
+        }
+    }
+
+    void encode_transaction_trace(encoded_block& b, uint32_t& num_ordinals, transaction_trace_v0& ttrace) {
+        auto* failed = !ttrace.failed_dtrx_trace.empty() ? &std::get<transaction_trace_v0>(ttrace.failed_dtrx_trace[0].recurse) : nullptr;
+        if (failed) {
+            if (!filter(config->trx_filters, *failed))
+                return;
+            encode_transaction_trace(b, num_ordinals, *failed);
+        }
+        auto transaction_ordinal = ++num_ordinals;
+
+        binary_fields fields{b.rows["transaction_trace"], false};
+        fields.native(b.block_num);
+        fields.native(int32_t(transaction_ordinal));
+        fields.native(failed ? std::string(failed->id) : "");
+        write_binary_fields(fields, ttrace);
+        auto* partial   = ttrace.partial ? &std::get<partial_transaction_v0>(*ttrace.partial) : nullptr;
+        auto  add_array = [&](auto* v, const char* element_type) {
+            fields.add(0, [&](std::string& array) {
+                push_array(array, builtin_oid(element_type), [&](std::string& elements) {
+                    if (!v)
+                        return 0;
+                    for (auto& x : *v)
+                        push_value(elements, [&](std::string& d) { return native_to_param(d, x); });
+                    return int(v->size());
+                });
+                return true;
+            });
+        };
+        add_array(partial ? &partial->signatures : nullptr, "varchar");
+        add_array(partial ? &partial->context_free_data : nullptr, "bytea");
+        fields.finish();
+        ++b.num_rows;
+
+        for (auto& atrace : ttrace.action_traces)
+            encode_action_trace(b, ttrace, std::get<action_trace_v0>(atrace));
+    } // encode_transaction_trace
+
+    void encode_action_trace(encoded_block& b, transaction_trace_v0& ttrace, action_trace_v0& atrace) {
+        std::string   row;
+        binary_fields fields{row, false};
+        fields.native(b.block_num);
+        fields.native((std::string)ttrace.id);
+        fields.native(ttrace.status);
+        write_binary_fields(fields, atrace);
+        fields.finish();
+        b.action_traces.emplace_back(atrace.act.account, std::move(row));
+        ++b.num_rows;
+
+        encode_action_trace_subtable(b, "action_trace_authorization", ttrace, atrace.action_ordinal.value, atrace.act.authorization);
+        if (atrace.receipt)
+            encode_action_trace_subtable(
+                b, "action_trace_auth_sequence", ttrace, atrace.action_ordinal.value,
+                std::get<action_receipt_v0>(*atrace.receipt).auth_sequence);
+        encode_action_trace_subtable(b, "action_trace_ram_delta", ttrace, atrace.action_ordinal.value, atrace.account_ram_deltas);
+    } // encode_action_trace
+
+    template <typename T>
+    void encode_action_trace_subtable(
+        encoded_block& b, const std::string& name, transaction_trace_v0& ttrace, int32_t action_ordinal, T& objects) {
+        auto&   dest = b.rows[name];
+        int32_t num  = 0;
+        for (auto& obj : objects) {
+            binary_fields fields{dest, false};
+            fields.native(b.block_num);
+            fields.native((std::string)ttrace.id);
+            fields.native(action_ordinal);
+            fields.native(++num);
+            fields.native(ttrace.status);
+            write_binary_fields(fields, obj);
+            fields.finish();
+            ++b.num_rows;
+        }
+    }
+
     void
     receive_block(uint32_t block_num, const checksum256& block_id, input_buffer bin, bool bulk, pqxx::work& t, pqxx::pipeline& pipeline) {
         signed_block block;
@@ -722,46 +1180,34 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
     } // receive_block
 
     void receive_deltas(uint32_t block_num, input_buffer bin, bool bulk, pqxx::work& t, pqxx::pipeline& pipeline) {
-        auto     num     = read_varuint32(bin);
-        unsigned numRows = 0;
+        auto num = read_varuint32(bin);
         for (uint32_t i = 0; i < num; ++i) {
-            check_variant(bin, get_type("table_delta"), "table_delta_v0");
-            table_delta_v0 table_delta;
-            bin_to_native(table_delta, bin);
-            
-	    if (table_delta.name == "global_property")
+            auto table_delta = read_table_delta(bin, get_type("table_delta"));
+            auto name        = std::string(table_delta.name);
+            if (name == "global_property")
                 continue;
 
-            auto& variant_type = get_type(table_delta.name);
+            auto& variant_type = get_type(name);
             if (!variant_type.filled_variant || variant_type.fields.size() != 1 || !variant_type.fields[0].type->filled_struct)
                 throw std::runtime_error("don't know how to proccess " + variant_type.name);
             auto& type = *variant_type.fields[0].type;
 
             size_t num_processed = 0;
-            for (auto& row : table_delta.rows) {
-                if (table_delta.rows.size() > 10000 && !(num_processed % 10000))
+            table_delta.for_each_row([&](auto& row) {
+                if (table_delta.num_rows > 10000 && !(num_processed % 10000))
                     ilog(
                         "block ${b} ${t} ${n} of ${r} bulk=${bulk}",
-                        ("b", block_num)("t", table_delta.name)("n", num_processed)("r", table_delta.rows.size())("bulk", bulk));
+                        ("b", block_num)("t", name)("n", num_processed)("r", table_delta.num_rows)("bulk", bulk));
                 check_variant(row.data, variant_type, 0u);
                 std::string fields = "block_num, present";
                 std::string values = std::to_string(block_num) + sep(bulk) + sql_str(bulk, row.present);
                 for (auto& field : type.fields)
                     fill_value(bulk, false, t, "", fields, values, row.data, field);
-                write(block_num, t, pipeline, bulk, table_delta.name, fields, values);
-
-                if(table_delta.name == "contract_table" && std::string::npos != values.find("stat")){
-                    std::vector<std::string> talbe_values = split_word (values, "\t");
-                    if(talbe_values.size() == 6 && std::find(token_codes.begin(), token_codes.end(), talbe_values[2]) == token_codes.end()){
-                        token_codes.push_back(talbe_values[2]);
-                        std::string table_value = "'" + talbe_values[2] + "'";
-                        write(block_num, t, pipeline, false, "token_account", "code", table_value);
-                    }
-                }
-
+                write(block_num, t, pipeline, bulk, name, fields, values);
+                if (name == "contract_table")
+                    check_token_code(block_num, t, pipeline, values);
                 ++num_processed;
-            }
-            numRows += table_delta.rows.size();
+            });
         }
     } // receive_deltas
 
@@ -825,9 +1271,8 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
             std::to_string(block_num) + sep(bulk) + quote(bulk, (std::string)ttrace.id) + sep(bulk) + quote(bulk, to_string(ttrace.status));
 
         write("action_trace", block_num, atrace, fields, values, bulk, t, pipeline);
-        if (std::find(token_codes.begin(), token_codes.end(),std::string(atrace.act.account))!=token_codes.end()){
+        if (is_token_code(atrace.act.account))
             write("token_action_trace", block_num, atrace, fields, values, bulk, t, pipeline);
-        }
         write_action_trace_subtable(
             "action_trace_authorization", block_num, ttrace, atrace.action_ordinal.value, atrace.act.authorization, bulk, t, pipeline);
         if (atrace.receipt)
@@ -902,6 +1347,28 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         });
     }
 
+    template <typename T>
+    void write_binary_field(binary_fields& fields, const T& obj) {
+        if constexpr (is_known_type(type_for<T>)) {
+            fields.add(get_oid(type_for<T>.name), [&](std::string& d) { return native_to_param(d, obj); });
+        } else if constexpr (abieos::is_optional_v<T>) {
+            fields.add(builtin_oid("bool"), [&](std::string& d) { return native_to_param(d, obj.has_value()); });
+            write_binary_field(fields, obj ? *obj : typename T::value_type{});
+        } else if constexpr (abieos::is_variant_v<T>) {
+            write_binary_fields(fields, std::get<0>(obj));
+        } else if constexpr (abieos::is_vector_v<T>) {
+        } else {
+            write_binary_fields(fields, obj);
+        }
+    }
+
+    template <typename T>
+    void write_binary_fields(binary_fields& fields, const T& obj) {
+        for_each_field((T*)nullptr, [&](const char* field_name, auto member_ptr) { //
+            write_binary_field(fields, member_from_void(member_ptr, &obj));
+        });
+    }
+
     template <typename T>
     void write(
         const std::string& name, uint32_t block_num, T& obj, std::string fields, std::string values, bool bulk, pqxx::work& t,
@@ -964,6 +1431,10 @@ void fill_pg_plugin::set_program_options(options_description& cli, options_descr
     auto clop = cli.add_options();
     clop("fpg-drop", "Drop (delete) schema and tables");
     clop("fpg-create", "Create schema and tables");
+    auto op = cfg.add_options();
+    op("fpg-binary-copy", "Use binary COPY in bulk mode");
+    op("fpg-threads", bpo::value<uint32_t>()->default_value(0),
+       "Threads which encode blocks for binary COPY in bulk mode. 0 encodes on the main thread");
 }
 
 void fill_pg_plugin::plugin_initialize(const variables_map& options) {
@@ -972,17 +1443,23 @@ void fill_pg_plugin::plugin_initialize(const variables_map& options) {
         if (endpoint.find(':') == std::string::npos)
             throw std::runtime_error("invalid endpoint: " + endpoint);
 
-        auto port                 = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
-        auto host                 = endpoint.substr(0, endpoint.find(':'));
-        my->config->host          = host;
-        my->config->port          = port;
-        my->config->schema        = options["pg-schema"].as<std::string>();
-        my->config->skip_to       = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
-        my->config->stop_before   = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
-        my->config->trx_filters   = fill_plugin::get_trx_filters(options);
-        my->config->drop_schema   = options.count("fpg-drop");
-        my->config->create_schema = options.count("fpg-create");
-        my->config->enable_trim   = options.count("fill-trim");
+        auto port                          = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
+        auto host                          = endpoint.substr(0, endpoint.find(':'));
+        my->config->host                   = host;
+        my->config->port                   = port;
+        my->config->schema                 = options["pg-schema"].as<std::string>();
+        my->config->skip_to                = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
+        my->config->stop_before            = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
+        my->config->trx_filters            = fill_plugin::get_trx_filters(options);
+        my->config->max_messages_in_flight = fill_plugin::get_max_messages_in_flight(options);
+        my->config->capture                = fill_plugin::get_capture(options);
+        my->config->drop_schema            = options.count("fpg-drop");
+        my->config->create_schema          = options.count("fpg-create");
+        my->config->enable_trim            = options.count("fill-trim");
+        my->config->binary_copy            = options.count("fpg-binary-copy");
+        my->config->encode_threads         = options["fpg-threads"].as<uint32_t>();
+        if (my->config->encode_threads)
+            my->workers = std::make_unique<asio::thread_pool>(my->config->encode_threads);
     }
     FC_LOG_AND_RETHROW()
 }
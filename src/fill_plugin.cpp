@@ -19,8 +19,11 @@ void fill_plugin::set_program_options(options_description& cli, options_descript
     auto clop = cli.add_options();
     op("fill-connect-to,f", bpo::value<std::string>()->default_value("127.0.0.1:8080"), "State-history endpoint to connect to (nodeos)");
     op("fill-trim,t", "Trim history before irreversible");
+    op("fill-max-in-flight", bpo::value<uint32_t>()->default_value(32),
+       "Maximum number of blocks nodeos sends ahead of the ones written; 0 for no limit");
     clop("fill-skip-to,k", bpo::value<uint32_t>(), "Skip blocks before [arg]");
     clop("fill-stop,x", bpo::value<uint32_t>(), "Stop before block [arg]");
+    clop("fill-capture", bpo::value<std::string>(), "Record the state-history stream to [arg] and [arg].index for replay");
     clop("fill-trx", bpo::value<std::vector<std::string>>(), "Filter transactions 'include:status:receiver:act_account:act_name'");
 }
 
@@ -65,3 +68,14 @@ std::vector<state_history::trx_filter> fill_plugin::get_trx_filters(const variab
         throw std::runtime_error("--fill-trx: "s + e.what());
     }
 }
+
+uint32_t fill_plugin::get_max_messages_in_flight(const variables_map& options) {
+    auto n = options["fill-max-in-flight"].as<uint32_t>();
+    return n ? n : 0xffff'ffff;
+}
+
+std::shared_ptr<state_history::capture_writer> fill_plugin::get_capture(const variables_map& options) {
+    if (!options.count("fill-capture"))
+        return nullptr;
+    return std::make_shared<state_history::capture_writer>(options["fill-capture"].as<std::string>());
+}
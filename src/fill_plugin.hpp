@@ -2,6 +2,7 @@
 
 #pragma once
 #include "state_history.hpp"
+#include "state_history_capture.hpp"
 #include <appbase/application.hpp>
 
 class fill_plugin : public appbase::plugin<fill_plugin> {
@@ -16,5 +17,7 @@ class fill_plugin : public appbase::plugin<fill_plugin> {
     void         plugin_startup();
     void         plugin_shutdown();
 
-    static std::vector<state_history::trx_filter> get_trx_filters(const appbase::variables_map& options);
+    static std::vector<state_history::trx_filter>         get_trx_filters(const appbase::variables_map& options);
+    static uint32_t                                       get_max_messages_in_flight(const appbase::variables_map& options);
+    static std::shared_ptr<state_history::capture_writer> get_capture(const appbase::variables_map& options);
 };
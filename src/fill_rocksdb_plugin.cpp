@@ -7,6 +7,7 @@
 
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
 #include <fc/exception/exception.hpp>
@@ -47,17 +48,49 @@ struct rocksdb_table {
 };
 
 struct fill_rocksdb_config : connection_config {
-    uint32_t                skip_to      = 0;
-    uint32_t                stop_before  = 0;
-    std::vector<trx_filter> trx_filters  = {};
-    bool                    enable_trim  = false;
-    bool                    enable_check = false;
+    uint32_t                skip_to        = 0;
+    uint32_t                stop_before    = 0;
+    std::vector<trx_filter> trx_filters    = {};
+    bool                    enable_trim    = false;
+    bool                    enable_check   = false;
+    uint32_t                bulk_blocks    = 0;
+    uint32_t                bulk_threads   = 0;
+    uint32_t                encode_threads = 0;
+};
+
+// Rows for a range of irreversible blocks, written to SST files (see rdb::write_sst_files), on a worker thread when
+// frdb-bulk-threads is set
+struct bulk_job {
+    uint32_t            last_block = 0;
+    std::string         filename_prefix;
+    rocksdb::WriteBatch content;
+    rocksdb::WriteBatch index;
+    rdb::sst_files      files;
+    std::promise<void>  done;
+    std::future<void>   ready = done.get_future();
+};
+
+static constexpr uint32_t delta_chunk_rows = 1'000;
+
+// Up to delta_chunk_rows rows of a table delta, encoded into their own batches on a frdb-encode-threads worker. Chunks are
+// appended to the active batches in the order they were queued, so the batches end up as if the rows were encoded inline.
+struct delta_chunk {
+    std::shared_ptr<flat_buffer> message; // rows point into it
+    rocksdb_table*               table     = nullptr;
+    uint32_t                     block_num = 0;
+    table_delta_view             rows      = {};
+    rocksdb::WriteBatch          content;
+    rocksdb::WriteBatch          index;
+    std::promise<void>           done;
+    std::future<void>            ready = done.get_future();
 };
 
 struct fill_rocksdb_plugin_impl : std::enable_shared_from_this<fill_rocksdb_plugin_impl> {
     std::shared_ptr<fill_rocksdb_config> config = std::make_shared<fill_rocksdb_config>();
     std::shared_ptr<::flm_session>       session;
     boost::asio::deadline_timer          timer;
+    std::unique_ptr<asio::thread_pool>   workers;
+    std::unique_ptr<asio::thread_pool>   encoders;
 
     fill_rocksdb_plugin_impl()
         : timer(app().get_io_service()) {}
@@ -91,10 +124,14 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     uint32_t                                   irreversible       = 0;
     abieos::checksum256                        irreversible_id    = {};
     uint32_t                                   first              = 0;
+    bool                                       bulk               = false;
+    std::deque<std::shared_ptr<bulk_job>>      bulk_jobs          = {};
+    std::deque<std::shared_ptr<delta_chunk>>   delta_chunks       = {};
 
     flm_session(fill_rocksdb_plugin_impl* my)
         : my(my)
-        , config(my->config) {}
+        , config(my->config)
+        , bulk(config->bulk_blocks != 0) {}
 
     void connect(asio::io_context& ioc) {
         connection = std::make_shared<state_history::connection>(ioc, *config, shared_from_this());
@@ -122,7 +159,9 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             for_each_subkey(
                 rocksdb_inst->database, kv::make_table_key(block_num, false, "recvd.block"_n),
                 kv::make_table_key(block_num, true, "recvd.block"_n), [&](auto&, auto k, auto) {
-                    if (block_num != 0 && (block_num < first || block_num > head))
+                    if (block_num != 0 && block_num < first)
+                        return true; // trimmed; compaction will remove it
+                    if (block_num > head)
                         throw std::runtime_error(
                             "Saw row for block_num " + std::to_string(block_num) +
                             ", which is out of range [first, head]. key: " + kv::key_to_string(orig_k));
@@ -144,6 +183,8 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         uint64_t     num_ti_keys = 0;
         abieos::name last_table, last_index;
         uint64_t     last_num_keys = 0;
+        uint64_t     num_stale     = 0;
+        auto         content_it    = rdb::new_total_order_iterator(rocksdb_inst->database, rdb::column::content);
         for_each(rocksdb_inst->database, kv::make_index_key(), kv::make_index_key(), [&](auto k, auto v) {
             abieos::name table, index;
             auto         kk = k;
@@ -172,15 +213,15 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             if (index_obj.table_obj->short_name != table)
                 throw std::runtime_error("index '" + (std::string)index + "' is not for table '" + (std::string)table + "'");
 
-            auto pk = extract_pk_from_index(k, *index_obj.table_obj, index_obj.sort_keys);
-            if (!rdb::exists(rocksdb_inst->database, rdb::to_slice(pk)))
-                throw std::runtime_error(
-                    "index '" + (std::string)index + "' references a missing entry in table '" + (std::string)table + "'");
+            if (!rdb::get_indexed_row(*content_it, k, *index_obj.table_obj, index_obj))
+                ++num_stale;
             return true;
         });
         ilog(
             "table '${t}' index '${i}' has ${e} entries", ("t", (std::string)last_table)("i", (std::string)last_index)("e", last_num_keys));
-        ilog("checked ${n} index entries", ("n", num_ti_keys));
+        ilog(
+            "checked ${n} index entries; ${s} are stale or trimmed and will be removed by compaction",
+            ("n", num_ti_keys)("s", num_stale));
         ilog("database appears ok");
     }
 
@@ -378,20 +419,15 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         else
             current_db_status = state_history::fill_status{
                 .head = head, .head_id = head_id, .irreversible = head, .irreversible_id = head_id, .first = first};
-        rdb::put(batch, kv::make_fill_status_key(), *current_db_status, true);
+        rdb::put(rocksdb_inst->database, batch, kv::make_fill_status_key(), *current_db_status, true);
     }
 
+    // Rows and received_blocks are range-deleted. Their index entries stay behind until rdb::history_filter drops them during
+    // compaction; readers skip them (see rdb::get_indexed_row).
     void truncate(uint32_t block) {
-        rocksdb_inst->database.flush(true, true);
-        rocksdb::WriteBatch content_batch, index_batch;
-        uint64_t            num_rows    = 0;
-        uint64_t            num_indexes = 0;
-        for_each(rocksdb_inst->database, kv::make_table_key(block), kv::make_table_key(), [&](auto k, auto v) {
-            remove_row(content_batch, index_batch, k, v, &num_rows, &num_indexes);
-            return true;
-        });
-
-        auto rb = rdb::get<kv::received_block>(rocksdb_inst->database, kv::make_received_block_key(block - 1), false);
+        auto& db       = rocksdb_inst->database;
+        auto  old_head = head;
+        auto  rb       = rdb::get<kv::received_block>(db, kv::make_received_block_key(block - 1), false);
         if (!rb) {
             head    = 0;
             head_id = {};
@@ -401,16 +437,22 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         }
         first = std::min(first, head);
 
-        // todo: should fill_status be written first?
-
-        // erase indexes before content
-        write(rocksdb_inst->database, index_batch);
-        write(rocksdb_inst->database, content_batch);
-
-        ilog("removed ${r} rows and ${i} index entries", ("r", num_rows)("i", num_indexes));
+        rocksdb::WriteBatch batch;
+        auto                begin = kv::make_table_key(block);
+        auto                end   = kv::make_table_key();
+        kv::inc_key(end);
+        for (auto c : {rdb::column::content, rdb::column::meta})
+            batch.DeleteRange(db.handle(c), rdb::to_slice(begin), rdb::to_slice(end));
+        // startup truncates just above the head, which normally removes nothing; don't leave history_filter a range to check
+        if (old_head >= block)
+            db.add_fork_range(batch, block, old_head);
+        write(db, batch);
+
+        ilog("removed blocks ${b} - ${e}", ("b", block)("e", old_head));
     }
 
     void end_write(bool write_fill) {
+        append_delta_chunks();
         if (write_fill)
             write_fill_status(active_index_batch);
 
@@ -419,11 +461,62 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         write(rocksdb_inst->database, active_index_batch);
     }
 
+    // Moves the rows written since the last bulk_job into a new one. At most frdb-bulk-threads jobs are in flight; beyond
+    // that the io thread waits, which also stops reading from nodeos. Jobs are ingested in order.
+    void queue_bulk() {
+        append_delta_chunks();
+        write_fill_status(active_index_batch);
+        auto job             = std::make_shared<bulk_job>();
+        job->last_block      = head;
+        job->filename_prefix = rdb::bulk_dir(rocksdb_inst->database) + "/" + std::to_string(head);
+        std::swap(job->content, active_content_batch);
+        std::swap(job->index, active_index_batch);
+
+        auto write_files = [inst = rocksdb_inst, job] {
+            try {
+                job->files = rdb::write_sst_files(inst->database, {&job->content, &job->index}, job->filename_prefix);
+                job->done.set_value();
+            } catch (...) {
+                job->done.set_exception(std::current_exception());
+            }
+        };
+        if (my && my->workers)
+            asio::post(*my->workers, write_files);
+        else
+            write_files();
+        bulk_jobs.push_back(job);
+        while (!bulk_jobs.empty() &&
+               (bulk_jobs.size() > config->bulk_threads || bulk_jobs.front()->ready.wait_for(0s) == std::future_status::ready))
+            ingest_next();
+    }
+
+    void ingest_next() {
+        auto job = std::move(bulk_jobs.front());
+        bulk_jobs.pop_front();
+        job->ready.get();
+        rdb::ingest(rocksdb_inst->database, job->files);
+        ilog("bulk load: ingested through block ${b}", ("b", job->last_block));
+    }
+
+    // Ingests what's left and switches to the normal write path
+    void end_bulk() {
+        if (!bulk)
+            return;
+        append_delta_chunks();
+        if (active_content_batch.Count() || active_index_batch.Count())
+            queue_bulk();
+        while (!bulk_jobs.empty())
+            ingest_next();
+        bulk = false;
+        ilog("bulk load: done; switching to normal writes at block ${b}", ("b", head + 1));
+    }
+
     bool received(get_blocks_result_v0& result) override {
         if (!result.this_block)
             return true;
         if (config->stop_before && result.this_block->block_num >= config->stop_before) {
             ilog("block ${b}: stop requested", ("b", result.this_block->block_num));
+            end_bulk();
             end_write(true);
             rocksdb_inst->database.flush(false, false);
             return false;
@@ -448,6 +541,10 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         */
 
         try {
+            bool near = result.this_block->block_num + 4 >= result.last_irreversible.block_num;
+            if (bulk && (near || result.this_block->block_num <= head))
+                end_bulk();
+
             if (result.this_block->block_num <= head) {
                 ilog("switch forks at block ${b}", ("b", result.this_block->block_num));
                 end_write(true);
@@ -455,7 +552,6 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
                 end_write(true);
             }
 
-            bool near       = result.this_block->block_num + 4 >= result.last_irreversible.block_num;
             bool commit_now = !(result.this_block->block_num % 200) || near;
             if (commit_now)
                 ilog("block ${b}", ("b", result.this_block->block_num));
@@ -478,10 +574,13 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
                 first = head;
 
             rdb::put(
-                active_content_batch, kv::make_received_block_key(result.this_block->block_num),
+                rocksdb_inst->database, active_content_batch, kv::make_received_block_key(result.this_block->block_num),
                 kv::received_block{result.this_block->block_num, result.this_block->block_id});
 
-            if (commit_now) {
+            if (bulk) {
+                if (!(result.this_block->block_num % config->bulk_blocks))
+                    queue_bulk();
+            } else if (commit_now) {
                 end_write(true);
                 if (config->enable_trim)
                     trim();
@@ -539,7 +638,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         std::vector<char> key;
         kv::append_table_key(key, block_num, present_k, table.kv_table->short_name);
         kv::extract_keys(key, {value.data(), value.data() + value.size()}, table.kv_table->keys, positions);
-        rdb::put(content_batch, key, value);
+        rdb::put(rocksdb_inst->database, content_batch, key, value);
 
         std::vector<char> index_key;
         for (auto* index : table.kv_table->indexes) {
@@ -547,53 +646,10 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             kv::append_index_key(index_key, table.kv_table->short_name, index->short_name);
             kv::extract_keys(index_key, {value.data(), value.data() + value.size()}, index->sort_keys, positions);
             kv::append_index_suffix(index_key, block_num, present_k);
-            index_batch.Put(rdb::to_slice(index_key), {});
+            index_batch.Put(rocksdb_inst->database.handle(rdb::column::index), rdb::to_slice(index_key), {});
         }
     }
 
-    void remove_row(
-        rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, abieos::input_buffer k, abieos::input_buffer v,
-        uint64_t* num_rows = nullptr, uint64_t* num_indexes = nullptr) {
-        uint32_t     block_num;
-        abieos::name table_name;
-        bool         present_k;
-        auto         temp_k = k;
-        kv::key_to_native<uint8_t>(temp_k);
-        kv::read_table_prefix(temp_k, block_num, table_name, present_k);
-
-        auto& table = get_kv_table(table_name);
-
-        std::vector<std::optional<uint32_t>> positions;
-        kv::init_positions(positions, table.fields.size());
-        kv::fill_positions(v, table.fields, positions);
-
-        std::vector<char> index_key;
-        for (auto* index : table.indexes) {
-            index_key.clear();
-            kv::append_index_key(index_key, table_name, index->short_name);
-            kv::extract_keys(index_key, v, index->sort_keys, positions);
-            kv::append_index_suffix(index_key, block_num, present_k);
-            index_batch.Delete(rdb::to_slice(index_key));
-            if (num_indexes)
-                ++*num_indexes;
-        }
-
-        content_batch.Delete(rdb::to_slice(k));
-        if (num_rows)
-            ++*num_rows;
-    }
-
-    void remove_row(
-        rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, abieos::input_buffer k, uint64_t* num_rows = nullptr,
-        uint64_t* num_indexes = nullptr) {
-
-        rocksdb::PinnableSlice v;
-        auto*                  db   = rocksdb_inst->database.db.get();
-        auto                   stat = db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), rdb::to_slice(k), &v);
-        rdb::check(stat, "get: ");
-        remove_row(content_batch, index_batch, k, rdb::to_input_buffer(v), num_rows, num_indexes);
-    }
-
     void receive_block(
         uint32_t block_num, const checksum256& block_id, input_buffer bin, rocksdb::WriteBatch& content_batch,
         rocksdb::WriteBatch& index_batch) {
@@ -621,31 +677,100 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
 
         auto num = read_varuint32(bin);
         for (uint32_t i = 0; i < num; ++i) {
-            check_variant(bin, table_delta_type, "table_delta_v0");
-            state_history::table_delta_v0 table_delta;
-            bin_to_native(table_delta, bin);
-            auto& table = get_table(table_delta.name);
+            auto  table_delta = state_history::read_table_delta(bin, table_delta_type);
+            auto  name        = std::string(table_delta.name);
+            auto& table       = get_table(name);
+            if (my && my->encoders) {
+                queue_delta_rows(table, block_num, table_delta);
+                continue;
+            }
 
             size_t num_processed = 0;
-            for (auto& row : table_delta.rows) {
-                if (table_delta.rows.size() > 10000 && !(num_processed % 10000)) {
-                    ilog(
-                        "block ${b} ${t} ${n} of ${r}",
-                        ("b", block_num)("t", table_delta.name)("n", num_processed)("r", table_delta.rows.size()));
+            table_delta.for_each_row([&](auto& row) {
+                if (table_delta.num_rows > 10000 && !(num_processed % 10000)) {
+                    ilog("block ${b} ${t} ${n} of ${r}", ("b", block_num)("t", name)("n", num_processed)("r", table_delta.num_rows));
+                    // in bulk mode too: this goes through the memtables, not the next SST file. That's intended; it keeps
+                    // a huge delta from growing one batch without bound, and its keys (tagged with block_num) can't
+                    // collide with a pending bulk_job's, so ingesting that job later doesn't hide anything
                     end_write(false);
                 }
-                check_variant(row.data, *table.abi_type, 0u);
-                value.clear();
-                abieos::native_to_bin(block_num, value);
-                abieos::native_to_bin(row.present, value);
-                for (auto& field : table.fields)
-                    fill(value, row.data, *field);
-                add_row(content_batch, index_batch, table, block_num, row.present, value);
+                add_delta_row(content_batch, index_batch, table, block_num, row, value);
                 ++num_processed;
-            }
+            });
         }
     } // receive_deltas
 
+    void add_delta_row(
+        rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, rocksdb_table& table, uint32_t block_num,
+        state_history::row row, std::vector<char>& value) {
+        check_variant(row.data, *table.abi_type, 0u);
+        value.clear();
+        abieos::native_to_bin(block_num, value);
+        abieos::native_to_bin(row.present, value);
+        for (auto& field : table.fields)
+            fill(value, row.data, *field);
+        add_row(content_batch, index_batch, table, block_num, row.present, value);
+    }
+
+    // Splits the delta into delta_chunks. While catching up, chunks from later blocks are encoded while earlier ones are
+    // appended; at most 4 chunks per thread are pending, beyond that the io thread waits. A delta with more than 10000 rows
+    // is written out every 10000 rows, as on the inline path.
+    //
+    // Unlike the inline path, a block's traces and received_block usually land in the batches before its delta rows, and
+    // may be followed by rows of later blocks. No two of these share a key, so the order inside a batch doesn't change what
+    // gets written.
+    void queue_delta_rows(rocksdb_table& table, uint32_t block_num, const table_delta_view& table_delta) {
+        auto     rest       = table_delta;
+        uint32_t num_queued = 0;
+        while (rest.num_rows) {
+            if (table_delta.num_rows > 10000 && !(num_queued % 10000)) {
+                ilog("block ${b} ${t} ${n} of ${r}", ("b", block_num)("t", table.name)("n", num_queued)("r", table_delta.num_rows));
+                end_write(false);
+            }
+
+            auto chunk       = std::make_shared<delta_chunk>();
+            chunk->message   = connection->message;
+            chunk->table     = &table;
+            chunk->block_num = block_num;
+            chunk->rows      = {rest.name, std::min(rest.num_rows, delta_chunk_rows), rest.rows};
+            auto end         = rest.rows.pos;
+            chunk->rows.for_each_row([&](auto& row) { end = row.data.end; });
+            chunk->rows.rows.end = end;
+            rest.rows.pos        = end;
+            rest.num_rows -= chunk->rows.num_rows;
+            num_queued += chunk->rows.num_rows;
+
+            asio::post(*my->encoders, [self = shared_from_this(), this, chunk] {
+                try {
+                    std::vector<char> value;
+                    chunk->rows.for_each_row([&](auto& row) {
+                        add_delta_row(chunk->content, chunk->index, *chunk->table, chunk->block_num, row, value);
+                    });
+                    chunk->done.set_value();
+                } catch (...) {
+                    chunk->done.set_exception(std::current_exception());
+                }
+            });
+            delta_chunks.push_back(chunk);
+            while (!delta_chunks.empty() && (delta_chunks.size() > 4 * config->encode_threads ||
+                                             delta_chunks.front()->ready.wait_for(0s) == std::future_status::ready))
+                append_next_chunk();
+        }
+    }
+
+    void append_next_chunk() {
+        auto chunk = std::move(delta_chunks.front());
+        delta_chunks.pop_front();
+        chunk->ready.get();
+        rdb::append_puts(rocksdb_inst->database, active_content_batch, chunk->content);
+        rdb::append_puts(rocksdb_inst->database, active_index_batch, chunk->index);
+    }
+
+    void append_delta_chunks() {
+        while (!delta_chunks.empty())
+            append_next_chunk();
+    }
+
     void receive_traces(rocksdb::WriteBatch& content_batch, rocksdb::WriteBatch& index_batch, uint32_t block_num, input_buffer bin) {
         auto     num          = read_varuint32(bin);
         uint32_t num_ordinals = 0;
@@ -739,72 +864,15 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
         // todo: account_ram_deltas
     }
 
+    // Rows are removed by compaction (see rdb::history_filter); this only moves the trim block
     void trim() {
         auto end_trim = std::min(head, irreversible);
         if (first >= end_trim)
             return;
-        rocksdb_inst->database.flush(true, true);
-        rocksdb::WriteBatch batch;
         ilog("trim: ${b} - ${e}", ("b", first)("e", end_trim));
-
-        uint64_t                    num_rows    = 0;
-        uint64_t                    num_indexes = 0;
-        std::set<std::vector<char>> trim_keys;
-
-        auto lower_bound = kv::make_table_key(first);
-        auto upper_bound = kv::make_table_key(end_trim);
-        rdb::for_each(rocksdb_inst->database, lower_bound, upper_bound, [&](auto k, auto v) {
-            uint32_t     block_num;
-            abieos::name table_name;
-            bool         present_k;
-            auto         temp_k = k;
-            kv::key_to_native<uint8_t>(temp_k);
-            kv::read_table_prefix(temp_k, block_num, table_name, present_k);
-
-            auto& table = get_kv_table(table_name);
-            if (table.trim_index_obj && block_num > first) {
-                std::vector<char>                    index_key;
-                std::vector<std::optional<uint32_t>> positions;
-                kv::init_positions(positions, table.fields.size());
-                kv::fill_positions(v, table.fields, positions);
-                kv::append_index_key(index_key, table_name, table.trim_index_obj->short_name);
-                kv::extract_keys(index_key, v, table.trim_index_obj->sort_keys, positions);
-                trim_keys.insert(std::move(index_key));
-            } else if (!table.trim_index_obj && block_num < end_trim) {
-                remove_row(batch, batch, k, v, &num_rows, &num_indexes);
-            }
-            return true;
-        });
-
-        for (auto& range : trim_keys) {
-            abieos::name         table_name;
-            abieos::name         index_name;
-            abieos::input_buffer rk{range.data(), range.data() + range.size()};
-            kv::key_to_native<uint8_t>(rk);
-            kv::read_index_prefix(rk, table_name, index_name);
-            auto& table = get_kv_table(table_name);
-            auto& index = *table.trim_index_obj;
-
-            uint32_t prev_block = 0xffff'ffff;
-            rdb::for_each(rocksdb_inst->database, range, range, [&](auto k, auto) {
-                std::vector<std::optional<uint32_t>> positions;
-                kv::init_positions(positions, table.fields.size());
-                uint32_t          block;
-                bool              present_k;
-                auto              suffix_pos = kv::fill_positions_from_index(k, index.sort_keys, block, present_k, positions);
-                std::vector<char> partial_k{k.pos, suffix_pos};
-
-                if (prev_block <= end_trim) {
-                    auto pk = extract_pk(k, table, block, present_k, positions);
-                    remove_row(batch, batch, {pk.data(), pk.data() + pk.size()}, &num_rows, &num_indexes);
-                }
-                prev_block = block;
-                return true;
-            });
-        }
-
-        ilog("trim: removed ${r} rows and ${d} index entries", ("r", num_rows)("d", num_indexes));
+        rocksdb::WriteBatch batch;
         first = end_trim;
+        rocksdb_inst->database.set_trim_block(batch, end_trim);
         write_fill_status(batch);
         write(rocksdb_inst->database, batch);
     }
@@ -842,6 +910,14 @@ fill_rocksdb_plugin::~fill_rocksdb_plugin() {}
 void fill_rocksdb_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto clop = cli.add_options();
     clop("frdb-check", "Check database");
+
+    auto op = cfg.add_options();
+    op("frdb-bulk-blocks", bpo::value<uint32_t>()->default_value(0),
+       "Load irreversible blocks by ingesting SST files of this many blocks each, instead of writing through memtables. "
+       "Switches to normal writes near the irreversible block. 0 disables.");
+    op("frdb-bulk-threads", bpo::value<uint32_t>()->default_value(2), "Threads writing SST files for frdb-bulk-blocks");
+    op("frdb-encode-threads", bpo::value<uint32_t>()->default_value(0),
+       "Threads encoding table delta rows; 0 encodes them on the main thread");
 }
 
 void fill_rocksdb_plugin::plugin_initialize(const variables_map& options) {
@@ -850,20 +926,32 @@ void fill_rocksdb_plugin::plugin_initialize(const variables_map& options) {
         if (endpoint.find(':') == std::string::npos)
             throw std::runtime_error("invalid endpoint: " + endpoint);
 
-        auto port                = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
-        auto host                = endpoint.substr(0, endpoint.find(':'));
-        my->config->host         = host;
-        my->config->port         = port;
-        my->config->skip_to      = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
-        my->config->stop_before  = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
-        my->config->trx_filters  = fill_plugin::get_trx_filters(options);
-        my->config->enable_trim  = options.count("fill-trim");
-        my->config->enable_check = options.count("frdb-check");
+        auto port                          = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
+        auto host                          = endpoint.substr(0, endpoint.find(':'));
+        my->config->host                   = host;
+        my->config->port                   = port;
+        my->config->skip_to                = options.count("fill-skip-to") ? options["fill-skip-to"].as<uint32_t>() : 0;
+        my->config->stop_before            = options.count("fill-stop") ? options["fill-stop"].as<uint32_t>() : 0;
+        my->config->trx_filters            = fill_plugin::get_trx_filters(options);
+        my->config->max_messages_in_flight = fill_plugin::get_max_messages_in_flight(options);
+        my->config->capture                = fill_plugin::get_capture(options);
+        my->config->enable_trim            = options.count("fill-trim");
+        my->config->enable_check           = options.count("frdb-check");
+        my->config->bulk_blocks            = options["frdb-bulk-blocks"].as<uint32_t>();
+        my->config->bulk_threads           = options["frdb-bulk-threads"].as<uint32_t>();
+        if (my->config->bulk_blocks && my->config->bulk_threads)
+            my->workers = std::make_unique<asio::thread_pool>(my->config->bulk_threads);
+        my->config->encode_threads = options["frdb-encode-threads"].as<uint32_t>();
+        if (my->config->encode_threads)
+            my->encoders = std::make_unique<asio::thread_pool>(my->config->encode_threads);
     }
     FC_LOG_AND_RETHROW()
 }
 
-void fill_rocksdb_plugin::plugin_startup() { my->start(); }
+void fill_rocksdb_plugin::plugin_startup() {
+    rdb::clear_bulk_dir(app().find_plugin<rocksdb_plugin>()->get_rocksdb_inst(false)->database);
+    my->start();
+}
 
 void fill_rocksdb_plugin::plugin_shutdown() {
     if (my->session)
@@ -26,6 +26,10 @@
 #include "wasm_ql_rocksdb_plugin.hpp"
 #endif
 
+#ifdef INCLUDE_REPLAY_PLUGIN
+#include "replay_plugin.hpp"
+#endif
+
 using namespace appbase;
 
 namespace fc {
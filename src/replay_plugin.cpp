@@ -0,0 +1,220 @@
+// copyright defined in LICENSE.txt
+
+#include "replay_plugin.hpp"
+#include "state_history_capture.hpp"
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <deque>
+#include <fc/exception/exception.hpp>
+
+using namespace appbase;
+using namespace state_history;
+using namespace std::literals;
+
+namespace asio      = boost::asio;
+namespace bpo       = boost::program_options;
+namespace websocket = boost::beast::websocket;
+
+using asio::ip::tcp;
+using boost::beast::flat_buffer;
+using boost::system::error_code;
+
+struct replay_config {
+    std::string file;
+    std::string host;
+    std::string port;
+};
+
+// Serves a capture (see --fill-capture) to one client the way nodeos's state_history_plugin does: the ABI, then replies to
+// get_status_request_v0, then the blocks asked for by get_blocks_request_v0. Like nodeos, it starts at the first block in
+// have_positions whose id doesn't match, and it never has more than max_messages_in_flight unacknowledged blocks.
+struct replay_session : std::enable_shared_from_this<replay_session> {
+    std::shared_ptr<capture_reader>                capture;
+    websocket::stream<tcp::socket>                 stream;
+    flat_buffer                                    in_buffer;
+    std::deque<std::shared_ptr<std::vector<char>>> write_queue;
+    uint32_t                                       next_block = 0;
+    uint32_t                                       end_block  = 0;
+    uint32_t                                       window     = 0;
+
+    replay_session(std::shared_ptr<capture_reader> capture, tcp::socket socket)
+        : capture(std::move(capture))
+        , stream(std::move(socket)) {
+        stream.binary(true);
+    }
+
+    void start() {
+        stream.async_accept([self = shared_from_this(), this](error_code ec) {
+            enter_callback(ec, "accept", [&] {
+                send(std::make_shared<std::vector<char>>(capture->abi.begin(), capture->abi.end()));
+                start_read();
+            });
+        });
+    }
+
+    void start_read() {
+        stream.async_read(in_buffer, [self = shared_from_this(), this](error_code ec, size_t) {
+            enter_callback(ec, "async_read", [&] {
+                auto                 data = in_buffer.data();
+                abieos::input_buffer bin{(const char*)data.data(), (const char*)data.data() + data.size()};
+                request              req;
+                bin_to_native(req, bin);
+                in_buffer.consume(in_buffer.size());
+                std::visit([&](auto& r) { received(r); }, req);
+                start_read();
+            });
+        });
+    }
+
+    void received(get_status_request_v0&) {
+        get_status_result_v0 status;
+        status.head.block_num          = capture->end_block() - 1;
+        status.head.block_id           = capture->find(status.head.block_num)->block_id;
+        status.last_irreversible       = capture->last_irreversible;
+        status.trace_begin_block       = capture->begin_block();
+        status.trace_end_block         = capture->end_block();
+        status.chain_state_begin_block = capture->begin_block();
+        status.chain_state_end_block   = capture->end_block();
+        auto bin                       = std::make_shared<std::vector<char>>();
+        abieos::native_to_bin(result{status}, *bin);
+        send(bin);
+    }
+
+    void received(get_blocks_request_v0& req) {
+        next_block = req.start_block_num;
+        end_block  = std::min(req.end_block_num, capture->end_block());
+        window     = req.max_messages_in_flight;
+        for (auto& pos : req.have_positions) {
+            auto* entry = capture->find(pos.block_num);
+            if (entry && entry->block_id.value != pos.block_id.value)
+                next_block = std::min(next_block, pos.block_num);
+        }
+        ilog("replay blocks ${b} - ${e}", ("b", next_block)("e", end_block));
+        send_blocks();
+    }
+
+    void received(get_blocks_ack_request_v0& req) {
+        window = std::min(uint64_t(window) + req.num_messages, uint64_t(0xffff'ffff));
+        send_blocks();
+    }
+
+    // Only a few blocks are read ahead of the socket, so an unlimited window doesn't load the whole capture
+    void send_blocks() {
+        while (window && write_queue.size() < 4 && next_block < end_block) {
+            auto* entry = capture->find(next_block++);
+            if (!entry)
+                continue;
+            send(std::make_shared<std::vector<char>>(capture->read(*entry)));
+            --window;
+            if (next_block == end_block)
+                ilog("replay: sent through block ${b}", ("b", next_block - 1));
+        }
+    }
+
+    void send(std::shared_ptr<std::vector<char>> bin) {
+        write_queue.push_back(std::move(bin));
+        if (write_queue.size() == 1)
+            start_write();
+    }
+
+    void start_write() {
+        stream.async_write(asio::buffer(*write_queue.front()), [self = shared_from_this(), this](error_code ec, size_t) {
+            enter_callback(ec, "async_write", [&] {
+                write_queue.pop_front();
+                if (!write_queue.empty())
+                    start_write();
+                send_blocks();
+            });
+        });
+    }
+
+    template <typename F>
+    void enter_callback(error_code ec, const char* what, F f) {
+        if (ec == websocket::error::closed)
+            return ilog("replay client closed");
+        if (ec)
+            return elog("${w}: ${m}", ("w", what)("m", ec.message()));
+        try {
+            f();
+        } catch (const std::exception& e) {
+            elog("${e}", ("e", e.what()));
+            close();
+        } catch (...) {
+            elog("unknown exception");
+            close();
+        }
+    }
+
+    void close() {
+        error_code ec;
+        stream.next_layer().close(ec);
+    }
+}; // replay_session
+
+struct replay_plugin_impl : std::enable_shared_from_this<replay_plugin_impl> {
+    replay_config                   config;
+    std::shared_ptr<capture_reader> capture;
+    std::unique_ptr<tcp::acceptor>  acceptor;
+
+    void start() {
+        capture = std::make_shared<capture_reader>(config.file);
+        ilog("replay ${f}: blocks ${b} - ${e}", ("f", config.file)("b", capture->begin_block())("e", capture->end_block() - 1));
+
+        tcp::resolver resolver(app().get_io_service());
+        auto          endpoint = *resolver.resolve(config.host, config.port).begin();
+        acceptor               = std::make_unique<tcp::acceptor>(app().get_io_service(), endpoint);
+        ilog("listening on ${h}:${p}", ("h", config.host)("p", config.port));
+        accept();
+    }
+
+    void accept() {
+        acceptor->async_accept([self = shared_from_this(), this](error_code ec, tcp::socket socket) {
+            if (ec) {
+                if (ec != asio::error::operation_aborted)
+                    elog("accept: ${m}", ("m", ec.message()));
+                return;
+            }
+            ilog("replay client connected");
+            std::make_shared<replay_session>(capture, std::move(socket))->start();
+            accept();
+        });
+    }
+};
+
+static abstract_plugin& _replay_plugin = app().register_plugin<replay_plugin>();
+
+replay_plugin::replay_plugin()
+    : my(std::make_shared<replay_plugin_impl>()) {}
+
+replay_plugin::~replay_plugin() {}
+
+void replay_plugin::set_program_options(options_description& cli, options_description& cfg) {
+    auto op = cfg.add_options();
+    op("replay-file", bpo::value<std::string>(), "Capture to serve (see --fill-capture)");
+    op("replay-listen", bpo::value<std::string>()->default_value("127.0.0.1:8080"), "Endpoint to serve the state-history protocol on");
+}
+
+void replay_plugin::plugin_initialize(const variables_map& options) {
+    try {
+        if (!options.count("replay-file"))
+            throw std::runtime_error("--replay-file is required");
+        auto endpoint = options.at("replay-listen").as<std::string>();
+        if (endpoint.find(':') == std::string::npos)
+            throw std::runtime_error("invalid endpoint: " + endpoint);
+
+        my->config.file = options["replay-file"].as<std::string>();
+        my->config.host = endpoint.substr(0, endpoint.find(':'));
+        my->config.port = endpoint.substr(endpoint.find(':') + 1, endpoint.size());
+    }
+    FC_LOG_AND_RETHROW()
+}
+
+void replay_plugin::plugin_startup() { my->start(); }
+
+void replay_plugin::plugin_shutdown() {
+    if (my->acceptor)
+        my->acceptor->close();
+    ilog("replay_plugin stopped");
+}
@@ -0,0 +1,20 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+#include <appbase/application.hpp>
+
+class replay_plugin : public appbase::plugin<replay_plugin> {
+  public:
+    APPBASE_PLUGIN_REQUIRES()
+
+    replay_plugin();
+    virtual ~replay_plugin();
+
+    virtual void set_program_options(appbase::options_description& cli, appbase::options_description& cfg) override;
+    void         plugin_initialize(const appbase::variables_map& options);
+    void         plugin_startup();
+    void         plugin_shutdown();
+
+  private:
+    std::shared_ptr<struct replay_plugin_impl> my;
+};
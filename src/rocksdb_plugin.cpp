@@ -9,12 +9,11 @@ using namespace appbase;
 using namespace std::literals;
 
 struct rocksdb_plugin_impl {
-    boost::filesystem::path         config_path    = {};
-    boost::filesystem::path         db_path        = {};
-    std::optional<uint32_t>         threads        = {};
-    std::optional<uint32_t>         max_open_files = {};
-    std::shared_ptr<::rocksdb_inst> rocksdb_inst   = {};
-    std::mutex                      mutex          = {};
+    boost::filesystem::path             config_path  = {};
+    boost::filesystem::path             db_path      = {};
+    state_history::rdb::database_config db_config    = {};
+    std::shared_ptr<::rocksdb_inst>     rocksdb_inst = {};
+    std::mutex                          mutex        = {};
 };
 
 static abstract_plugin& _rocksdb_plugin = app().register_plugin<rocksdb_plugin>();
@@ -33,6 +32,24 @@ void rocksdb_plugin::set_program_options(options_description& cli, options_descr
     op("rdb-max-files", bpo::value<uint32_t>(),
        "RocksDB limit max number of open files (default unlimited). This should be smaller than 'ulimit -n #'. "
        "# should be a very large number for full-history nodes.");
+    op("rdb-block-cache", bpo::value<uint32_t>()->default_value(512), "RocksDB block cache size, in MiB");
+    op("rdb-bloom-bits", bpo::value<uint32_t>()->default_value(10),
+       "Bloom filter bits per key. 0 disables bloom filters and prefix seeks.");
+    op("rdb-partition-filters", bpo::bool_switch()->default_value(false),
+       "Use partitioned index and filter blocks. Recommended for full-history databases whose filters don't fit in the block "
+       "cache.");
+    op("rdb-compression", bpo::value<std::string>()->default_value("lz4"),
+       "Compression for levels below L1, except the bottommost: none, lz4, or zstd");
+    op("rdb-bottommost-compression", bpo::value<std::string>()->default_value("zstd"),
+       "Compression for the bottommost level, which holds most of the data: none, lz4, or zstd");
+    op("rdb-zstd-dict", bpo::value<uint32_t>()->default_value(16),
+       "Dictionary size, in KiB, for zstd on the bottommost level. 0 disables dictionaries.");
+    op("rdb-options-file", bpo::value<std::string>(),
+       "Load RocksDB options from this OPTIONS file instead of using rdb-threads, rdb-max-files, rdb-block-cache, "
+       "rdb-bloom-bits, rdb-partition-filters, and the compression options");
+
+    auto clop = cli.add_options();
+    clop("rdb-migrate", "Convert a database from the single column family layout");
 }
 
 void rocksdb_plugin::plugin_initialize(const variables_map& options) {
@@ -40,9 +57,23 @@ void rocksdb_plugin::plugin_initialize(const variables_map& options) {
         my->config_path = options["query-config"].as<std::string>().c_str();
         my->db_path     = options["rdb-database"].as<std::string>();
         if (!options["rdb-threads"].empty())
-            my->threads = options["rdb-threads"].as<uint32_t>();
+            my->db_config.threads = options["rdb-threads"].as<uint32_t>();
         if (!options["rdb-max-files"].empty())
-            my->max_open_files = options["rdb-max-files"].as<uint32_t>();
+            my->db_config.max_open_files = options["rdb-max-files"].as<uint32_t>();
+        my->db_config.block_cache_size  = uint64_t(options["rdb-block-cache"].as<uint32_t>()) << 20;
+        my->db_config.bloom_bits        = options["rdb-bloom-bits"].as<uint32_t>();
+        my->db_config.partition_filters = options["rdb-partition-filters"].as<bool>();
+        my->db_config.migrate           = options.count("rdb-migrate");
+        if (options["rdb-options-file"].empty()) {
+            my->db_config.compression = state_history::rdb::compression_from_string(options["rdb-compression"].as<std::string>());
+            my->db_config.bottommost_compression =
+                state_history::rdb::compression_from_string(options["rdb-bottommost-compression"].as<std::string>());
+            my->db_config.zstd_dict_size = options["rdb-zstd-dict"].as<uint32_t>() << 10;
+        }
+        if (!options["rdb-options-file"].empty()) {
+            my->db_config.options_file = options["rdb-options-file"].as<std::string>();
+            ilog("rdb-options-file is set; ignoring other rdb-* tuning options");
+        }
     }
     FC_LOG_AND_RETHROW()
 }
@@ -58,6 +89,7 @@ static void open_query_config(rocksdb_plugin_impl* my, std::shared_ptr<rocksdb_i
         abieos::json_to_native(*query_config, read_string(my->config_path.c_str()));
         query_config->prepare(state_history::kv::abi_type_to_kv_type);
         inst->query_config = std::move(query_config);
+        inst->database.set_query_config(inst->query_config.get());
     } catch (const std::exception& e) {
         inst.reset();
         throw std::runtime_error("error processing "s + my->config_path.c_str() + ": " + e.what());
@@ -67,7 +99,7 @@ static void open_query_config(rocksdb_plugin_impl* my, std::shared_ptr<rocksdb_i
 std::shared_ptr<rocksdb_inst> rocksdb_plugin::get_rocksdb_inst(bool fast_reads) {
     std::lock_guard<std::mutex> lock(my->mutex);
     if (!my->rocksdb_inst) {
-        my->rocksdb_inst = std::make_shared<rocksdb_inst>(my->db_path.c_str(), my->threads, my->max_open_files, fast_reads);
+        my->rocksdb_inst = std::make_shared<rocksdb_inst>(my->db_path.c_str(), my->db_config, fast_reads);
         open_query_config(my.get(), my->rocksdb_inst);
     }
     return my->rocksdb_inst;
@@ -10,8 +10,8 @@ struct rocksdb_inst {
     state_history::rdb::database                     database;
     std::unique_ptr<const state_history::kv::config> query_config{};
 
-    rocksdb_inst(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads)
-        : database{db_path, threads, max_open_files, fast_reads} {}
+    rocksdb_inst(const char* db_path, const state_history::rdb::database_config& db_config, bool fast_reads)
+        : database{db_path, db_config, fast_reads} {}
 };
 
 class rocksdb_plugin : public appbase::plugin<rocksdb_plugin> {
@@ -481,6 +481,50 @@ inline void check_variant(abieos::input_buffer& bin, const abieos::abi_type& typ
         throw std::runtime_error("expected "s + expected + " got " + type.fields[index].name);
 }
 
+// A table_delta_v0 read in place. The rows are decoded one at a time by for_each_row and their data points into the
+// message, so a delta with many rows costs no allocations.
+struct table_delta_view {
+    std::string_view     name     = {};
+    uint32_t             num_rows = 0;
+    abieos::input_buffer rows     = {};
+
+    template <typename F>
+    void for_each_row(F f) const {
+        auto bin = rows;
+        row  r;
+        for (uint32_t i = 0; i < num_rows; ++i) {
+            r.present = abieos::read_raw<bool>(bin);
+            r.data    = read_bytes(bin);
+            f(r);
+        }
+    }
+
+    static abieos::input_buffer read_bytes(abieos::input_buffer& bin) {
+        auto size = abieos::read_varuint32(bin);
+        if (size > uint32_t(bin.end - bin.pos))
+            throw std::runtime_error("table_delta: read past end");
+        abieos::input_buffer result{bin.pos, bin.pos + size};
+        bin.pos += size;
+        return result;
+    }
+};
+
+// Reads the table_delta variant at bin and advances bin past it
+inline table_delta_view read_table_delta(abieos::input_buffer& bin, const abieos::abi_type& table_delta_type) {
+    check_variant(bin, table_delta_type, "table_delta_v0");
+    table_delta_view result;
+    auto             name = table_delta_view::read_bytes(bin);
+    result.name           = {name.pos, size_t(name.end - name.pos)};
+    result.num_rows       = abieos::read_varuint32(bin);
+    auto begin            = bin.pos;
+    for (uint32_t i = 0; i < result.num_rows; ++i) {
+        abieos::read_raw<bool>(bin);
+        table_delta_view::read_bytes(bin);
+    }
+    result.rows = {begin, bin.pos};
+    return result;
+}
+
 struct trx_filter {
     bool                              include     = {};
     std::optional<transaction_status> status      = {};
@@ -0,0 +1,124 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include "state_history.hpp"
+
+#include <fstream>
+#include <map>
+
+namespace state_history {
+
+// A capture holds what a state-history endpoint sent a filler, so a fill can be repeated without nodeos (see replay_plugin).
+//
+// <file> holds records of [uint32 size][bytes], host byte order. The first record is the ABI; each following record is a
+// serialized `result` holding a get_blocks_result_v0, exactly as received. <file>.index holds a capture_index_entry per
+// block record.
+struct capture_index_entry {
+    uint32_t            block_num = 0;
+    abieos::checksum256 block_id  = {};
+    uint64_t            offset    = 0; // of the record's size
+};
+
+struct capture_writer {
+    std::ofstream data;
+    std::ofstream index;
+    uint64_t      offset = 0;
+
+    explicit capture_writer(const std::string& filename)
+        : data(filename, std::ios::binary | std::ios::trunc)
+        , index(filename + ".index", std::ios::binary | std::ios::trunc) {
+        if (!data || !index)
+            throw std::runtime_error("can not create capture " + filename);
+    }
+
+    // each connection (including retries) starts with the ABI; only the first is kept
+    void write_abi(std::string_view abi) {
+        if (!offset)
+            write_record(abi.data(), abi.size());
+    }
+
+    void write_result(const get_blocks_result_v0& result, const char* message, size_t size) {
+        if (!result.this_block)
+            return;
+        if (!offset)
+            throw std::runtime_error("capture: result before abi");
+        index.write((const char*)&result.this_block->block_num, sizeof(uint32_t));
+        index.write((const char*)result.this_block->block_id.value.data(), result.this_block->block_id.value.size());
+        index.write((const char*)&offset, sizeof(uint64_t));
+        write_record(message, size);
+        data.flush();
+        index.flush();
+        if (!index)
+            throw std::runtime_error("capture: write failed");
+    }
+
+  private:
+    void write_record(const char* p, size_t size) {
+        uint32_t n = size;
+        data.write((const char*)&n, sizeof(n));
+        data.write(p, size);
+        if (!data)
+            throw std::runtime_error("capture: write failed");
+        offset += sizeof(n) + size;
+    }
+};
+
+struct capture_reader {
+    std::ifstream                    data;
+    std::string                      abi;
+    std::vector<capture_index_entry> entries;
+    std::map<uint32_t, size_t>       by_block; // block_num -> entry; a block captured again after a fork replaces the old one
+    block_position                   last_irreversible = {};
+
+    explicit capture_reader(const std::string& filename)
+        : data(filename, std::ios::binary) {
+        if (!data)
+            throw std::runtime_error("can not open capture " + filename);
+        auto bytes = read_record(0);
+        abi.assign(bytes.begin(), bytes.end());
+
+        std::ifstream index(filename + ".index", std::ios::binary);
+        if (!index)
+            throw std::runtime_error("can not open capture index " + filename + ".index");
+        capture_index_entry entry;
+        while (index.read((char*)&entry.block_num, sizeof(uint32_t)) &&
+               index.read((char*)entry.block_id.value.data(), entry.block_id.value.size()) &&
+               index.read((char*)&entry.offset, sizeof(uint64_t))) {
+            by_block[entry.block_num] = entries.size();
+            entries.push_back(entry);
+        }
+        if (entries.empty())
+            throw std::runtime_error("capture " + filename + " has no blocks");
+
+        auto                 last = read(entries.back());
+        abieos::input_buffer bin{last.data(), last.data() + last.size()};
+        result               r;
+        bin_to_native(r, bin);
+        last_irreversible = std::get<get_blocks_result_v0>(r).last_irreversible;
+    }
+
+    uint32_t begin_block() const { return by_block.begin()->first; }
+    uint32_t end_block() const { return by_block.rbegin()->first + 1; }
+
+    const capture_index_entry* find(uint32_t block_num) const {
+        auto it = by_block.find(block_num);
+        return it == by_block.end() ? nullptr : &entries[it->second];
+    }
+
+    std::vector<char> read(const capture_index_entry& entry) { return read_record(entry.offset); }
+
+  private:
+    std::vector<char> read_record(uint64_t offset) {
+        uint32_t size = 0;
+        data.seekg(offset);
+        data.read((char*)&size, sizeof(size));
+        std::vector<char> result(size);
+        data.read(result.data(), size);
+        if (!data)
+            throw std::runtime_error("capture: read failed");
+        return result;
+    }
+};
+
+} // namespace state_history
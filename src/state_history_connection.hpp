@@ -3,12 +3,15 @@
 #pragma once
 
 #include "state_history.hpp"
+#include "state_history_capture.hpp"
 
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
+#include <deque>
 #include <fc/exception/exception.hpp>
+#include <mutex>
 
 namespace state_history {
 
@@ -21,8 +24,49 @@ struct connection_callbacks {
 };
 
 struct connection_config {
-    std::string host;
-    std::string port;
+    std::string                     host;
+    std::string                     port;
+    uint32_t                        max_messages_in_flight = 0xffff'ffff; // 0xffff'ffff: no flow control
+    std::shared_ptr<capture_writer> capture;                              // records what is received
+};
+
+// Receive buffers are returned here when the last reference to a message goes away, which may be on another thread (see
+// connection::message). Reused buffers keep their capacity, so catching up doesn't allocate a new multi-MB buffer per block.
+struct buffer_pool : std::enable_shared_from_this<buffer_pool> {
+    using flat_buffer = boost::beast::flat_buffer;
+
+    static constexpr size_t initial_size = 1024 * 1024;
+    static constexpr size_t max_free     = 8;
+
+    std::mutex                                mutex;
+    std::vector<std::unique_ptr<flat_buffer>> free;
+
+    std::shared_ptr<flat_buffer> get() {
+        std::unique_ptr<flat_buffer> buffer;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!free.empty()) {
+                buffer = std::move(free.back());
+                free.pop_back();
+            }
+        }
+        if (!buffer) {
+            buffer = std::make_unique<flat_buffer>();
+            buffer->reserve(initial_size);
+        }
+        return {buffer.release(), [pool = weak_from_this()](flat_buffer* p) {
+                    std::unique_ptr<flat_buffer> buffer{p};
+                    if (auto self = pool.lock())
+                        self->put(std::move(buffer));
+                }};
+    }
+
+    void put(std::unique_ptr<flat_buffer> buffer) {
+        buffer->consume(buffer->size());
+        std::lock_guard<std::mutex> lock{mutex};
+        if (free.size() < max_free)
+            free.push_back(std::move(buffer));
+    }
 };
 
 struct connection : std::enable_shared_from_this<connection> {
@@ -37,13 +81,17 @@ struct connection : std::enable_shared_from_this<connection> {
     using jobject      = abieos::jobject;
     using jvalue       = abieos::jvalue;
 
-    connection_config                            config;
-    std::shared_ptr<connection_callbacks>        callbacks;
-    tcp::resolver                                resolver;
-    boost::beast::websocket::stream<tcp::socket> stream;
-    bool                                         have_abi  = false;
-    abi_def                                      abi       = {};
-    std::map<std::string, abi_type>              abi_types = {};
+    connection_config                              config;
+    std::shared_ptr<connection_callbacks>          callbacks;
+    tcp::resolver                                  resolver;
+    boost::beast::websocket::stream<tcp::socket>   stream;
+    bool                                           have_abi  = false;
+    abi_def                                        abi       = {};
+    std::map<std::string, abi_type>                abi_types = {};
+    std::shared_ptr<flat_buffer>                   message;  // result being delivered; callbacks may hold it past received()
+    uint32_t                                       unacked   = 0;
+    std::deque<std::shared_ptr<std::vector<char>>> write_queue;
+    std::shared_ptr<buffer_pool>                   buffers   = std::make_shared<buffer_pool>();
 
     connection(boost::asio::io_context& ioc, const connection_config& config, std::shared_ptr<connection_callbacks> callbacks)
         : config(config)
@@ -75,7 +123,7 @@ struct connection : std::enable_shared_from_this<connection> {
     }
 
     void start_read() {
-        auto in_buffer = std::make_shared<flat_buffer>();
+        auto in_buffer = buffers->get();
         stream.async_read(*in_buffer, [self = shared_from_this(), this, in_buffer](error_code ec, size_t) {
             enter_callback(ec, "async_read", [&] {
                 if (!have_abi)
@@ -98,6 +146,8 @@ struct connection : std::enable_shared_from_this<connection> {
         abieos::check_abi_version(abi.version);
         abi_types = abieos::create_contract(abi).abi_types;
         have_abi  = true;
+        if (config.capture)
+            config.capture->write_abi(sv);
         if (callbacks)
             callbacks->received_abi(sv);
     }
@@ -107,19 +157,41 @@ struct connection : std::enable_shared_from_this<connection> {
         input_buffer          bin{(const char*)data.data(), (const char*)data.data() + data.size()};
         state_history::result result;
         bin_to_native(result, bin);
-        return callbacks && std::visit([&](auto& r) { return callbacks->received(r); }, result);
+        if (config.capture && std::holds_alternative<get_blocks_result_v0>(result))
+            config.capture->write_result(std::get<get_blocks_result_v0>(result), (const char*)data.data(), data.size());
+        message = p;
+        bool ok = callbacks && std::visit([&](auto& r) { return callbacks->received(r); }, result);
+        message.reset();
+        if (ok && std::holds_alternative<get_blocks_result_v0>(result))
+            ack_result();
+        return ok;
+    }
+
+    // nodeos stops sending once max_messages_in_flight results are unacknowledged. A result is acknowledged when its
+    // callback returns, which isn't when it's committed: fill-pg's bulk COPY batches and --fpg-threads queue, and
+    // fill-rocksdb's 200-block commits, --frdb-encode-threads chunks and --frdb-bulk-blocks jobs, hold blocks past that.
+    // The window bounds blocks not yet handed to the filler; each of those filler queues has its own bound on top. Acks
+    // are batched to half the window.
+    void ack_result() {
+        if (config.max_messages_in_flight == 0xffff'ffff)
+            return;
+        if (++unacked >= std::max(config.max_messages_in_flight / 2, 1u)) {
+            send(get_blocks_ack_request_v0{unacked});
+            unacked = 0;
+        }
     }
 
     void request_blocks(uint32_t start_block_num, const std::vector<block_position>& positions) {
         get_blocks_request_v0 req;
         req.start_block_num        = start_block_num;
         req.end_block_num          = 0xffff'ffff;
-        req.max_messages_in_flight = 0xffff'ffff;
+        req.max_messages_in_flight = config.max_messages_in_flight;
         req.have_positions         = positions;
         req.irreversible_only      = false;
         req.fetch_block            = true;
         req.fetch_traces           = true;
         req.fetch_deltas           = true;
+        unacked                    = 0;
         send(req);
     }
 
@@ -141,11 +213,23 @@ struct connection : std::enable_shared_from_this<connection> {
         return it->second;
     }
 
+    // websocket allows one outstanding write; acks may be sent while a previous request is still being written
     void send(const request& req) {
         auto bin = std::make_shared<std::vector<char>>();
         abieos::native_to_bin(req, *bin);
+        write_queue.push_back(bin);
+        if (write_queue.size() == 1)
+            start_write();
+    }
+
+    void start_write() {
+        auto bin = write_queue.front();
         stream.async_write(boost::asio::buffer(*bin), [self = shared_from_this(), bin, this](error_code ec, size_t) {
-            enter_callback(ec, "async_write", [&] {});
+            enter_callback(ec, "async_write", [&] {
+                write_queue.pop_front();
+                if (!write_queue.empty())
+                    start_write();
+            });
         });
     }
 
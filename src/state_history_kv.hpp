@@ -376,6 +376,23 @@ ABIEOS_REFLECT(received_block) {
 }
 
 inline std::vector<char> make_received_block_key(uint32_t block) { return make_table_key(block, true, "recvd.block"_n); }
+
+// Blocks [begin_block, end_block] were removed by a fork switch. Their index entries may be stale (see index_matches_row).
+struct fork_range {
+    uint32_t begin_block = {};
+    uint32_t end_block   = {};
+};
+
+ABIEOS_REFLECT(fork_range) {
+    ABIEOS_MEMBER(fork_range, begin_block)
+    ABIEOS_MEMBER(fork_range, end_block)
+}
+
+inline std::vector<char> make_fork_ranges_key() { return make_table_key(0, true, "fork.ranges"_n); }
+
+// Rows older than the trim block (a uint32) are removed by compaction, except the newest version of trimmable rows
+inline std::vector<char> make_trim_block_key() { return make_table_key(0, true, "trim.block"_n); }
+
 inline std::vector<char> make_block_info_key(uint32_t block) { return make_table_key(block, true, "block.info"_n); }
 
 inline void append_transaction_trace_key(std::vector<char>& dest, uint32_t block, const abieos::checksum256 transaction_id) {
@@ -532,5 +549,19 @@ inline std::vector<char> extract_pk_from_index(abieos::input_buffer index, const
     return extract_pk(index, table, block, present_k, positions);
 }
 
+// True if row, found at the primary key extracted from index, would produce index. A fork switch removes rows without
+// removing their index entries; a stale entry's row is either missing or was rewritten by the new fork.
+inline bool index_matches_row(abieos::input_buffer index, abieos::input_buffer row, const kv::table& table, const kv::index& index_obj) {
+    std::vector<std::optional<uint32_t>> positions;
+    init_positions(positions, table.fields.size());
+    fill_positions(row, table.fields, positions);
+
+    std::vector<char> expected;
+    append_index_key(expected, table.short_name, index_obj.short_name);
+    extract_keys(expected, row, index_obj.sort_keys, positions);
+    size_t suffix_size = sizeof(uint32_t) + sizeof(bool);
+    return size_t(index.end - index.pos) == expected.size() + suffix_size && !memcmp(expected.data(), index.pos, expected.size());
+}
+
 } // namespace kv
 } // namespace state_history
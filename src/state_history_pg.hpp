@@ -4,11 +4,15 @@
 #include "query_config.hpp"
 #include "state_history.hpp"
 
+#include <libpq-fe.h>
 #include <pqxx/pqxx>
 
 namespace state_history {
 namespace pg {
 
+// fill-pg notifies this channel whenever it updates fill_status
+inline std::string fill_status_channel(const std::string& schema) { return schema + ".fill_status"; }
+
 inline std::string null_value(bool bulk) {
     if (bulk)
         return "\\N";
@@ -268,6 +272,141 @@ inline std::string empty_to_sql<abieos::input_buffer>(pqxx::connection&, bool bu
     return quote_bytea(bulk, "");
 }
 
+// PostgreSQL binary parameter format. These return false when the parameter should be null.
+
+template <typename T>
+void push_be(std::string& dest, T v) {
+    std::make_unsigned_t<T> u = v;
+    for (int i = sizeof(T) - 1; i >= 0; --i)
+        dest.push_back(char(u >> (i * 8)));
+}
+
+// numeric: ndigits, weight, sign, dscale, then base-10000 digits
+inline void push_numeric(std::string& dest, const std::string& decimal) {
+    bool neg = !decimal.empty() && decimal[0] == '-';
+    auto pos = decimal.find_first_not_of("0", neg ? 1 : 0);
+    auto s   = pos == std::string::npos ? std::string{} : decimal.substr(pos);
+    s.insert(0, (4 - s.size() % 4) % 4, '0');
+
+    std::vector<int16_t> digits;
+    for (size_t i = 0; i < s.size(); i += 4)
+        digits.push_back(int16_t(std::stoi(s.substr(i, 4))));
+    int16_t weight = digits.size() - 1;
+    while (!digits.empty() && !digits.back())
+        digits.pop_back();
+    if (digits.empty())
+        weight = 0;
+
+    push_be(dest, int16_t(digits.size()));
+    push_be(dest, weight);
+    push_be(dest, uint16_t(neg && !digits.empty() ? 0x4000 : 0));
+    push_be(dest, uint16_t(0));
+    for (auto d : digits)
+        push_be(dest, d);
+}
+
+// microseconds since 2000-01-01
+inline void push_timestamp(std::string& dest, int64_t us_since_1970) { push_be(dest, us_since_1970 - 946'684'800'000'000ll); }
+
+// clang-format off
+inline bool native_to_param(std::string& dest, bool v)                                 { dest.push_back(v); return true; }
+inline bool native_to_param(std::string& dest, uint8_t v)                              { push_be(dest, int16_t(v)); return true; }
+inline bool native_to_param(std::string& dest, int8_t v)                               { push_be(dest, int16_t(v)); return true; }
+inline bool native_to_param(std::string& dest, uint16_t v)                             { push_be(dest, int32_t(v)); return true; }
+inline bool native_to_param(std::string& dest, int16_t v)                              { push_be(dest, v); return true; }
+inline bool native_to_param(std::string& dest, uint32_t v)                             { push_be(dest, int64_t(v)); return true; }
+inline bool native_to_param(std::string& dest, int32_t v)                              { push_be(dest, v); return true; }
+inline bool native_to_param(std::string& dest, uint64_t v)                             { push_numeric(dest, std::to_string(v)); return true; }
+inline bool native_to_param(std::string& dest, int64_t v)                              { push_be(dest, v); return true; }
+inline bool native_to_param(std::string& dest, double v)                               { uint64_t u; memcpy(&u, &v, sizeof(u)); push_be(dest, u); return true; }
+inline bool native_to_param(std::string& dest, abieos::varuint32 v)                    { push_be(dest, int64_t(v.value)); return true; }
+inline bool native_to_param(std::string& dest, abieos::varint32 v)                     { push_be(dest, int32_t(v.value)); return true; }
+inline bool native_to_param(std::string& dest, const abieos::int128& v)                { push_numeric(dest, std::string(v)); return true; }
+inline bool native_to_param(std::string& dest, const abieos::uint128& v)               { push_numeric(dest, std::string(v)); return true; }
+inline bool native_to_param(std::string& dest, abieos::name v)                         { if (v.value) dest += std::string(v); return true; }
+inline bool native_to_param(std::string& dest, abieos::time_point v)                   { if (!v.microseconds) return false; push_timestamp(dest, v.microseconds); return true; }
+inline bool native_to_param(std::string& dest, abieos::time_point_sec v)               { if (!v.utc_seconds) return false; push_timestamp(dest, v.utc_seconds * 1'000'000ll); return true; }
+inline bool native_to_param(std::string& dest, abieos::block_timestamp v)              { if (!v.slot) return false; push_be(dest, int64_t(v.slot) * 500'000); return true; }
+inline bool native_to_param(std::string& dest, const abieos::checksum256& v)           { if (v.value != abieos::checksum256{}.value) dest += std::string(v); return true; }
+inline bool native_to_param(std::string& dest, const abieos::public_key& v)            { dest += public_key_to_string(v); return true; }
+inline bool native_to_param(std::string& dest, const abieos::signature& v)             { dest += signature_to_string(v); return true; }
+inline bool native_to_param(std::string& dest, transaction_status v)                   { dest += to_string(v); return true; }
+inline bool native_to_param(std::string& dest, abieos::symbol v)                       { dest += abieos::symbol_to_string(v.value); return true; }
+// clang-format on
+
+inline bool native_to_param(std::string& dest, const abieos::float128& v) {
+    std::string error;
+    auto        h = std::string(v);
+    if (!abieos::unhex(error, h.begin(), h.end(), std::back_inserter(dest)))
+        throw std::runtime_error("native_to_param(float128): " + error);
+    return true;
+}
+
+inline bool native_to_param(std::string& dest, const std::string& v) {
+    dest += v;
+    return true;
+}
+
+inline bool native_to_param(std::string& dest, const abieos::bytes& v) {
+    dest.append(v.data.begin(), v.data.end());
+    return true;
+}
+
+inline bool native_to_param(std::string& dest, const abieos::input_buffer& v) {
+    dest.append(v.pos, v.end);
+    return true;
+}
+
+template <typename T>
+bool native_to_param(std::string& dest, const std::optional<T>& v) {
+    if (v)
+        return native_to_param(dest, *v);
+    else if constexpr (std::is_arithmetic_v<T>)
+        return native_to_param(dest, T{});
+    else
+        return abieos::is_string_v<T>;
+}
+
+template <typename T>
+bool empty_to_param(std::string& dest) {
+    return native_to_param(dest, T{});
+}
+
+template <typename T>
+bool bin_to_param(std::string& dest, abieos::input_buffer& bin) {
+    if constexpr (abieos::is_optional_v<T>) {
+        if (abieos::read_raw<bool>(bin))
+            return bin_to_param<typename T::value_type>(dest, bin);
+        else if constexpr (std::is_arithmetic_v<typename T::value_type>)
+            return native_to_param(dest, typename T::value_type{});
+        else
+            return abieos::is_string_v<typename T::value_type>;
+    } else {
+        return native_to_param(dest, abieos::read_raw<T>(bin));
+    }
+}
+
+template <>
+inline bool bin_to_param<std::string>(std::string& dest, abieos::input_buffer& bin) {
+    dest += read_string(bin);
+    return true;
+}
+
+template <>
+inline bool bin_to_param<abieos::bytes>(std::string& dest, abieos::input_buffer& bin) {
+    auto size = abieos::read_varuint32(bin);
+    if (size > bin.end - bin.pos)
+        throw abieos::error("invalid bytes size");
+    dest.append(bin.pos, bin.pos + size);
+    bin.pos += size;
+    return true;
+}
+
+template <>
+inline bool bin_to_param<abieos::input_buffer>(std::string&, abieos::input_buffer&) {
+    throw abieos::error("bin_to_param: input_buffer unsupported");
+}
+
 inline abieos::time_point sql_to_time_point(std::string s) {
     if (s.empty())
         return {};
@@ -325,12 +464,179 @@ template <> inline void sql_to_bin<abieos::input_buffer>       (std::vector<char
 template <> inline void sql_to_bin<abieos::symbol>             (std::vector<char>& bin, const pqxx::field& f) { abieos::native_to_bin( abieos::string_to_symbol(f.c_str()), bin); }
 // clang-format on
 
+// COPY ... with (format binary), binary composites, and binary arrays
+
+inline const std::string copy_header{"PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19};
+
+// Appends a length-prefixed value. f appends the value and returns false for null.
+template <typename F>
+void push_value(std::string& dest, F f) {
+    auto pos = dest.size();
+    dest.append(4, '\0');
+    int32_t size = -1;
+    if (f(dest))
+        size = dest.size() - pos - 4;
+    else
+        dest.resize(pos + 4);
+    for (int i = 0; i < 4; ++i)
+        dest[pos + i] = char(uint32_t(size) >> (24 - i * 8));
+}
+
+// OIDs of the built-in types used by type_for<>. Types created in the schema (enums, composites) aren't here.
+inline uint32_t builtin_oid(std::string_view sql_type) {
+    if (sql_type == "bool")
+        return 16;
+    if (sql_type == "bytea")
+        return 17;
+    if (sql_type == "bigint")
+        return 20;
+    if (sql_type == "smallint")
+        return 21;
+    if (sql_type == "integer")
+        return 23;
+    if (sql_type == "float8")
+        return 701;
+    if (sql_type.substr(0, 7) == "varchar")
+        return 1043;
+    if (sql_type == "timestamp")
+        return 1114;
+    if (sql_type == "decimal")
+        return 1700;
+    return 0;
+}
+
+// One-dimensional array. add_elements(dest) appends each element with push_value and returns the count.
+template <typename F>
+void push_array(std::string& dest, uint32_t element_oid, F add_elements) {
+    auto pos = dest.size();
+    push_be(dest, int32_t(1)); // ndim
+    push_be(dest, int32_t(0)); // flags
+    push_be(dest, element_oid);
+    auto dim_pos = dest.size();
+    push_be(dest, int32_t(0)); // size
+    push_be(dest, int32_t(1)); // lower bound
+    int32_t n = add_elements(dest);
+    if (!n) {
+        dest.resize(pos);
+        push_be(dest, int32_t(0));
+        push_be(dest, int32_t(0));
+        push_be(dest, element_oid);
+        return;
+    }
+    for (int i = 0; i < 4; ++i)
+        dest[dim_pos + i] = char(uint32_t(n) >> (24 - i * 8));
+}
+
+struct pg_conn_deleter {
+    void operator()(PGconn* conn) const { PQfinish(conn); }
+};
+
+struct pg_result_deleter {
+    void operator()(PGresult* result) const { PQclear(result); }
+};
+
+using pg_conn_ptr   = std::unique_ptr<PGconn, pg_conn_deleter>;
+using pg_result_ptr = std::unique_ptr<PGresult, pg_result_deleter>;
+
+// PostgreSQL binary result format. data is nullptr when the value is null.
+
+template <typename T>
+T read_be(const char* data, int len) {
+    if (!data || len != sizeof(T))
+        throw std::runtime_error("unexpected null or size in binary result");
+    std::make_unsigned_t<T> u = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        u = (u << 8) | uint8_t(data[i]);
+    return u;
+}
+
+inline uint64_t numeric_to_uint64(const char* data, int len) {
+    if (!data || len < 8)
+        throw std::runtime_error("unexpected null or size in binary result");
+    auto ndigits = read_be<int16_t>(data, 2);
+    auto weight  = read_be<int16_t>(data + 2, 2);
+    auto sign    = read_be<uint16_t>(data + 4, 2);
+    if (sign || len != 8 + 2 * ndigits)
+        throw std::runtime_error("numeric is out of range");
+    uint64_t result = 0;
+    for (int i = 0; i <= weight; ++i)
+        result = result * 10000 + (i < ndigits ? read_be<int16_t>(data + 8 + 2 * i, 2) : 0);
+    return result;
+}
+
+inline std::string result_to_string(const char* data, int len) { return data ? std::string(data, len) : std::string{}; }
+
+inline abieos::time_point result_to_time_point(const char* data, int len) {
+    if (!data)
+        return {};
+    return abieos::time_point{uint64_t(read_be<int64_t>(data, len) + 946'684'800'000'000ll)};
+}
+
+template <typename T>
+void result_to_bin(std::vector<char>& bin, const char* data, int len) {
+    if constexpr (abieos::is_optional_v<T>)
+        throw std::runtime_error("result_to_bin<optional<T>> not implemented");
+    else
+        abieos::native_to_bin(read_be<T>(data, len), bin);
+}
+
+inline abieos::block_timestamp result_to_block_timestamp(const char* data, int len) {
+    abieos::block_timestamp result;
+    if (data)
+        result.slot = read_be<int64_t>(data, len) / 500'000;
+    return result;
+}
+
+// clang-format off
+template <>
+inline void result_to_bin<transaction_status>(std::vector<char>& bin, const char* data, int len) {
+    auto s = result_to_string(data, len);
+    if (false) {}
+    else if (s == "executed")  abieos::native_to_bin( (uint8_t)transaction_status::executed, bin);
+    else if (s == "soft_fail") abieos::native_to_bin( (uint8_t)transaction_status::soft_fail, bin);
+    else if (s == "hard_fail") abieos::native_to_bin( (uint8_t)transaction_status::hard_fail, bin);
+    else if (s == "delayed")   abieos::native_to_bin( (uint8_t)transaction_status::delayed, bin);
+    else if (s == "expired")   abieos::native_to_bin( (uint8_t)transaction_status::expired, bin);
+    else
+        throw std::runtime_error("invalid value for transaction_status: " + s);
+}
+// clang-format on
+
+// clang-format off
+template <> inline void result_to_bin<bool>                       (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( bool(read_be<uint8_t>(data, len)), bin); }
+template <> inline void result_to_bin<uint8_t>                    (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( (uint8_t)read_be<int16_t>(data, len), bin); }
+template <> inline void result_to_bin<int8_t>                     (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( (int8_t)read_be<int16_t>(data, len), bin); }
+template <> inline void result_to_bin<uint16_t>                   (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( (uint16_t)read_be<int32_t>(data, len), bin); }
+template <> inline void result_to_bin<uint32_t>                   (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( (uint32_t)read_be<int64_t>(data, len), bin); }
+template <> inline void result_to_bin<uint64_t>                   (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( numeric_to_uint64(data, len), bin); }
+template <> inline void result_to_bin<double>                     (std::vector<char>& bin, const char* data, int len) { auto u = read_be<uint64_t>(data, len); double d; memcpy(&d, &u, sizeof(d)); abieos::native_to_bin(d, bin); }
+template <> inline void result_to_bin<abieos::varuint32>          (std::vector<char>& bin, const char* data, int len) { abieos::push_varuint32(bin, (uint32_t)read_be<int64_t>(data, len)); }
+template <> inline void result_to_bin<abieos::varint32>           (std::vector<char>& bin, const char* data, int len) { abieos::push_varint32(bin, read_be<int32_t>(data, len)); }
+template <> inline void result_to_bin<abieos::int128>             (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<int128> not implemented"); }
+template <> inline void result_to_bin<abieos::uint128>            (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<uint128> not implemented"); }
+template <> inline void result_to_bin<abieos::float128>           (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<float128> not implemented"); }
+template <> inline void result_to_bin<abieos::name>               (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( abieos::name{result_to_string(data, len).c_str()}, bin); }
+template <> inline void result_to_bin<abieos::time_point>         (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( result_to_time_point(data, len), bin); }
+template <> inline void result_to_bin<abieos::time_point_sec>     (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<time_point_sec> not implemented"); }
+template <> inline void result_to_bin<abieos::block_timestamp>    (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( result_to_block_timestamp(data, len), bin); }
+template <> inline void result_to_bin<abieos::checksum256>        (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( sql_to_checksum256(result_to_string(data, len).c_str()), bin); }
+template <> inline void result_to_bin<abieos::public_key>         (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<public_key> not implemented"); }
+template <> inline void result_to_bin<abieos::signature>          (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<signature> not implemented"); }
+template <> inline void result_to_bin<abieos::bytes>              (std::vector<char>& bin, const char* data, int len) { abieos::push_varuint32(bin, data ? len : 0); bin.insert(bin.end(), data, data ? data + len : data); }
+template <> inline void result_to_bin<std::string>                (std::vector<char>& bin, const char* data, int len) { abieos::push_varuint32(bin, data ? len : 0); bin.insert(bin.end(), data, data ? data + len : data); }
+template <> inline void result_to_bin<abieos::input_buffer>       (std::vector<char>& bin, const char* data, int len) { throw std::runtime_error("result_to_bin<input_buffer> not implemented"); }
+template <> inline void result_to_bin<abieos::symbol>             (std::vector<char>& bin, const char* data, int len) { abieos::native_to_bin( abieos::string_to_symbol(result_to_string(data, len).c_str()), bin); }
+// clang-format on
+
 struct type {
     const char* name                                                          = "";
     std::string (*bin_to_sql)(pqxx::connection&, bool, abieos::input_buffer&) = nullptr;
     std::string (*native_to_sql)(pqxx::connection&, bool, const void*)        = nullptr;
     std::string (*empty_to_sql)(pqxx::connection&, bool)                      = nullptr;
     void (*sql_to_bin)(std::vector<char>& bin, const pqxx::field&)            = nullptr;
+    bool (*bin_to_param)(std::string& dest, abieos::input_buffer& bin)         = nullptr;
+    void (*result_to_bin)(std::vector<char>& bin, const char* data, int len)   = nullptr;
+    bool (*empty_to_param)(std::string& dest)                                  = nullptr;
 };
 
 template <typename T>
@@ -348,7 +654,7 @@ inline constexpr unknown_type<T> type_for;
 
 template <typename T>
 constexpr type make_type_for(const char* name) {
-    return type{name, bin_to_sql<T>, native_to_sql<T>, empty_to_sql<T>, sql_to_bin<T>};
+    return type{name, bin_to_sql<T>, native_to_sql<T>, empty_to_sql<T>, sql_to_bin<T>, bin_to_param<T>, result_to_bin<T>, empty_to_param<T>};
 }
 
 // clang-format off
@@ -5,7 +5,15 @@
 
 #include <boost/filesystem.hpp>
 #include <fc/exception/exception.hpp>
+#include <rocksdb/cache.h>
+#include <rocksdb/compaction_filter.h>
+#include <rocksdb/convenience.h>
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/sst_file_writer.h>
+#include <rocksdb/table.h>
+#include <rocksdb/utilities/options_util.h>
 
 namespace state_history {
 namespace rdb {
@@ -20,17 +28,271 @@ inline void check(rocksdb::Status s, const char* prefix) {
         throw std::runtime_error(std::string(prefix) + s.ToString());
 }
 
+inline rocksdb::Slice to_slice(const std::vector<char>& v) { return {v.data(), v.size()}; }
+
+inline rocksdb::Slice to_slice(abieos::input_buffer v) { return {v.pos, size_t(v.end - v.pos)}; }
+
+inline abieos::input_buffer to_input_buffer(rocksdb::Slice v) { return {v.data(), v.data() + v.size()}; }
+
+inline abieos::input_buffer to_input_buffer(rocksdb::PinnableSlice& v) { return {v.data(), v.data() + v.size()}; }
+
+// Prefixes follow the key layout in state_history_kv.hpp: index keys are grouped by (table, index) and table keys by
+// (block, table, present). Query seeks stay within one prefix, so prefix bloom filters can skip most SST files. Scans which
+// cross prefixes (for_each and for_each_subkey on a database) use total_order_seek.
+class key_prefix_extractor : public rocksdb::SliceTransform {
+  public:
+    static size_t prefix_size(const rocksdb::Slice& key) {
+        if (key.empty())
+            return 0;
+        if (uint8_t(key[0]) == uint8_t(kv::key_tag::index))
+            return 1 + 8 + 8;
+        if (uint8_t(key[0]) == uint8_t(kv::key_tag::table))
+            return 1 + 4 + 8 + 1;
+        return 0;
+    }
+
+    const char*    Name() const override { return "history_tools.key_prefix"; }
+    rocksdb::Slice Transform(const rocksdb::Slice& key) const override { return {key.data(), prefix_size(key)}; }
+    bool           InDomain(const rocksdb::Slice& key) const override { return prefix_size(key) && key.size() >= prefix_size(key); }
+};
+
+// Column families. Every family keeps the key layout in state_history_kv.hpp; column_for() picks the family from the key.
+// Index entries (empty values, scanned by prefix) and the small, hot metadata rows get their own compaction and filter
+// settings instead of sharing content's.
+enum class column : uint8_t {
+    content, // key_tag::table rows
+    index,   // key_tag::index entries
+    meta,    // fill.status, fork.ranges, trim.block, and recvd.block
+};
+
+inline const std::vector<std::string> column_names = {"content", "index", "meta"};
+
+inline column column_for(rocksdb::Slice key) {
+    if (!key.empty() && uint8_t(key[0]) == uint8_t(kv::key_tag::index))
+        return column::index;
+
+    // the table name follows the tag and block number
+    static const std::vector<char> meta_keys[] = {
+        kv::make_fill_status_key(), kv::make_fork_ranges_key(), kv::make_trim_block_key(), kv::make_received_block_key(0)};
+    const size_t pos  = 1 + 4;
+    const size_t size = 8;
+    if (key.size() >= pos + size)
+        for (auto& meta_key : meta_keys)
+            if (!memcmp(key.data() + pos, meta_key.data() + pos, size))
+                return column::meta;
+    return column::content;
+}
+
+inline rocksdb::CompressionType compression_from_string(const std::string& name) {
+    rocksdb::CompressionType result;
+    if (name == "none")
+        result = rocksdb::kNoCompression;
+    else if (name == "lz4")
+        result = rocksdb::kLZ4Compression;
+    else if (name == "zstd")
+        result = rocksdb::kZSTD;
+    else
+        throw std::runtime_error("unknown compression: " + name + "; expected none, lz4, or zstd");
+    auto supported = rocksdb::GetSupportedCompressions();
+    if (result != rocksdb::kNoCompression && std::find(supported.begin(), supported.end(), result) == supported.end())
+        throw std::runtime_error("rocksdb was built without " + name + " support");
+    return result;
+}
+
+struct database_config {
+    std::optional<uint32_t>  threads                = {};
+    std::optional<uint32_t>  max_open_files         = {};
+    uint64_t                 block_cache_size       = 512ull << 20;
+    uint32_t                 bloom_bits             = 10; // 0 disables bloom filters and the prefix extractor
+    bool                     partition_filters      = false;
+    rocksdb::CompressionType compression            = rocksdb::kNoCompression; // levels below L1, except the bottommost
+    rocksdb::CompressionType bottommost_compression = rocksdb::kNoCompression;
+    uint32_t                 zstd_dict_size         = 0; // bottommost zstd dictionary; 0 disables
+    std::string              options_file           = {}; // RocksDB OPTIONS file; replaces the settings above
+    bool                     migrate                = false;
+};
+
+// Cleanup for fill_rocksdb, done by compaction instead of on the ingestion thread:
+// * truncate() range-deletes a fork's rows but not their index entries. Entries in a recorded fork_range are checked
+//   against content, and dropped if stale (see kv::index_matches_row).
+// * trim() only moves the trim block. Rows older than it are dropped, except in tables with a trim index, where a row is
+//   only dropped once a newer version at or below the trim block supersedes it. Index entries are dropped with their rows.
+struct history_filter_state {
+    std::vector<kv::fork_range> forks      = {};
+    uint32_t                    trim_block = 0; // 0: trim is disabled
+};
+
+struct history_filter_context {
+    std::atomic<rocksdb::DB*>                   db      = nullptr;
+    rocksdb::ColumnFamilyHandle*                content = nullptr;
+    rocksdb::ColumnFamilyHandle*                index   = nullptr;
+    std::atomic<const kv::config*>              config  = nullptr; // until set, compaction keeps everything
+    std::shared_ptr<const history_filter_state> state   = std::make_shared<history_filter_state>();
+};
+
+class history_filter : public rocksdb::CompactionFilter {
+  public:
+    rocksdb::DB*                                db;
+    const history_filter_context&               context;
+    const kv::config&                           config;
+    std::shared_ptr<const history_filter_state> state;
+    bool                                        is_index;
+    mutable std::unique_ptr<rocksdb::Iterator>  index_it;
+
+    history_filter(
+        rocksdb::DB* db, const history_filter_context& context, const kv::config& config,
+        std::shared_ptr<const history_filter_state> state, bool is_index)
+        : db(db)
+        , context(context)
+        , config(config)
+        , state(std::move(state))
+        , is_index(is_index) {}
+
+    const char* Name() const override { return "history_tools.history"; }
+
+    bool Filter(int, const rocksdb::Slice& key, const rocksdb::Slice& value, std::string*, bool*) const override {
+        try {
+            if (is_index)
+                return filter_index(to_input_buffer(key));
+            else
+                return filter_row(to_input_buffer(key), to_input_buffer(value));
+        } catch (...) {
+            return false;
+        }
+    }
+
+    bool in_fork(uint32_t block) const {
+        auto fork = std::upper_bound(
+            state->forks.begin(), state->forks.end(), block, [](uint32_t block, auto& fork) { return block < fork.begin_block; });
+        return fork != state->forks.begin() && block <= std::prev(fork)->end_block;
+    }
+
+    bool has_row(abieos::input_buffer entry, const kv::index& index) const {
+        auto                   pk = kv::extract_pk_from_index(entry, *index.table_obj, index.sort_keys);
+        rocksdb::PinnableSlice row;
+        auto                   stat = db->Get(rocksdb::ReadOptions(), context.content, to_slice(pk), &row);
+        if (stat.IsNotFound())
+            return false;
+        check(stat, "history_filter: ");
+        return kv::index_matches_row(entry, to_input_buffer(row), *index.table_obj, index);
+    }
+
+    bool filter_index(abieos::input_buffer entry) const {
+        auto         bin = entry;
+        abieos::name table_name, index_name;
+        kv::key_to_native<uint8_t>(bin);
+        kv::read_index_prefix(bin, table_name, index_name);
+        auto it = config.index_name_map.find(index_name);
+        if (it == config.index_name_map.end() || it->second->table_obj->short_name != table_name)
+            return false;
+        auto& index = *it->second;
+
+        std::vector<std::optional<uint32_t>> positions;
+        kv::init_positions(positions, index.table_obj->fields.size());
+        uint32_t block;
+        bool     present_k;
+        kv::fill_positions_from_index(entry, index.sort_keys, block, present_k, positions);
+        bool trimmed = block < state->trim_block;
+        if (trimmed && !index.table_obj->trim_index_obj)
+            return true;
+        if (!trimmed && !in_fork(block))
+            return false;
+        return !has_row(entry, index);
+    }
+
+    bool filter_row(abieos::input_buffer key, abieos::input_buffer value) const {
+        if (kv::bin_to_key_tag(key) != kv::key_tag::table)
+            return false;
+        uint32_t     block;
+        abieos::name table_name;
+        bool         present_k;
+        kv::read_table_prefix(key, block, table_name, present_k);
+        if (!block || block >= state->trim_block)
+            return false;
+        auto it = config.table_name_map.find(table_name);
+        if (it == config.table_name_map.end())
+            return false;
+        auto& table = *it->second;
+        if (!table.trim_index_obj)
+            return true;
+        return superseded(table, *table.trim_index_obj, block, value);
+    }
+
+    // True if the trim index has a version of this row newer than block, but not newer than the trim block
+    bool superseded(const kv::table& table, const kv::index& trim_index, uint32_t block, abieos::input_buffer value) const {
+        std::vector<std::optional<uint32_t>> positions;
+        kv::init_positions(positions, table.fields.size());
+        kv::fill_positions(value, table.fields, positions);
+        std::vector<char> prefix;
+        kv::append_index_key(prefix, table.short_name, trim_index.short_name);
+        kv::extract_keys(prefix, value, trim_index.sort_keys, positions);
+        auto lower_bound = prefix;
+        kv::append_index_suffix(lower_bound, state->trim_block);
+
+        if (!index_it) {
+            rocksdb::ReadOptions options;
+            options.total_order_seek = true;
+            index_it.reset(db->NewIterator(options, context.index));
+        }
+        for (index_it->Seek(to_slice(lower_bound)); index_it->Valid(); index_it->Next()) {
+            auto k = index_it->key();
+            if (k.size() < prefix.size() || memcmp(k.data(), prefix.data(), prefix.size()))
+                break;
+            abieos::input_buffer suffix{k.data() + prefix.size(), k.data() + k.size()};
+            uint32_t             version_block;
+            bool                 version_present;
+            kv::read_index_suffix(suffix, version_block, version_present);
+            if (version_block <= block)
+                return false;
+            if (!in_fork(version_block) || has_row(to_input_buffer(k), trim_index))
+                return true;
+        }
+        check(index_it->status(), "history_filter: ");
+        return false;
+    }
+};
+
+class history_filter_factory : public rocksdb::CompactionFilterFactory {
+  public:
+    std::shared_ptr<history_filter_context> context;
+    bool                                    is_index;
+
+    history_filter_factory(std::shared_ptr<history_filter_context> context, bool is_index)
+        : context(std::move(context))
+        , is_index(is_index) {}
+
+    const char* Name() const override { return "history_tools.history"; }
+
+    std::unique_ptr<rocksdb::CompactionFilter> CreateCompactionFilter(const rocksdb::CompactionFilter::Context&) override {
+        auto* db     = context->db.load();
+        auto* config = context->config.load();
+        auto  state  = std::atomic_load(&context->state);
+        if (!db || !config || (state->forks.empty() && !state->trim_block))
+            return nullptr;
+        return std::make_unique<history_filter>(db, *context, *config, std::move(state), is_index);
+    }
+};
+
 struct database {
-    std::shared_ptr<rocksdb::Statistics> stats;
-    std::unique_ptr<rocksdb::DB>         db;
+    std::shared_ptr<history_filter_context>   filter_context = std::make_shared<history_filter_context>();
+    std::shared_ptr<rocksdb::Statistics>      stats;
+    std::unique_ptr<rocksdb::DB>              db;
+    std::vector<rocksdb::ColumnFamilyHandle*> handles; // indexed by column, followed by the default family
+    std::string                               path;
+
+    database(const char* db_path, const database_config& config, bool fast_reads)
+        : path(db_path) {
+        if (!config.options_file.empty()) {
+            open_from_file(db_path, config.options_file);
+            check_layout(db_path, config);
+            log_stats();
+            return;
+        }
 
-    database(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads) {
-        rocksdb::DB*     p;
         rocksdb::Options options;
         // stats = options.statistics = rocksdb::CreateDBStatistics();
         // stats->set_stats_level(rocksdb::kExceptTimeForMutex);
         // options.stats_dump_period_sec = 2;
-        options.create_if_missing = true;
 
         options.level_compaction_dynamic_level_bytes = true;
         options.max_background_compactions           = 4;
@@ -38,11 +300,10 @@ struct database {
         options.bytes_per_sync                       = 1048576;
         options.compaction_pri                       = rocksdb::kMinOverlappingRatio;
 
-        if (threads)
-            options.IncreaseParallelism(*threads);
+        if (config.threads)
+            options.IncreaseParallelism(*config.threads);
         options.OptimizeLevelStyleCompaction(256ull << 20);
-        for (auto& x : options.compression_per_level) // todo: fix snappy build
-            x = rocksdb::kNoCompression;
+        set_compression(options, config);
 
         if (fast_reads) {
             ilog("open ${p}: fast reader mode; writes will be slower", ("p", db_path));
@@ -51,45 +312,277 @@ struct database {
             options.memtable_factory                = std::make_shared<rocksdb::VectorRepFactory>();
             options.allow_concurrent_memtable_write = false;
         }
-        if (max_open_files)
-            options.max_open_files = *max_open_files;
+        if (config.max_open_files)
+            options.max_open_files = *config.max_open_files;
+
+        auto                         cache = rocksdb::NewLRUCache(config.block_cache_size);
+        rocksdb::ColumnFamilyOptions content(options), index(options), meta(options);
+        set_table_options(content, config, cache, 4 << 10, true);
+        set_table_options(index, config, cache, 16 << 10, true); // keys only; larger blocks make prefix scans cheaper
+        set_table_options(meta, config, cache, 4 << 10, false);
+        meta.write_buffer_size = 16 << 20;
+        set_compression(meta, {});
+        ilog(
+            "block cache: ${c} MiB, bloom bits: ${b}, partitioned index/filters: ${p}",
+            ("c", config.block_cache_size >> 20)("b", config.bloom_bits)("p", config.partition_filters));
+
+        open(db_path, options, {{column_names[0], content}, {column_names[1], index}, {column_names[2], meta}});
+        check_layout(db_path, config);
+        log_stats();
+    }
+
+    // L0 and L1 are rewritten often, so they stay uncompressed. The bottommost level holds most of the data (mostly cold
+    // contract_row history), so it gets the strongest compression; zstd can use a dictionary trained per SST file.
+    static void set_compression(rocksdb::ColumnFamilyOptions& options, const database_config& config) {
+        for (size_t i = 0; i < options.compression_per_level.size(); ++i)
+            options.compression_per_level[i] = i < 2 ? rocksdb::kNoCompression : config.compression;
+        options.bottommost_compression = config.bottommost_compression;
+        if (config.bottommost_compression == rocksdb::kZSTD && config.zstd_dict_size) {
+            options.bottommost_compression_opts.enabled              = true;
+            options.bottommost_compression_opts.max_dict_bytes       = config.zstd_dict_size;
+            options.bottommost_compression_opts.zstd_max_train_bytes = 100 * config.zstd_dict_size;
+        }
+    }
+
+    void log_stats() {
+        for (size_t i = 0; i < column_names.size(); ++i) {
+            uint64_t sst_size = 0, live_size = 0, num_keys = 0, l0_files = 0, levels = 0;
+            db->GetIntProperty(handles[i], "rocksdb.total-sst-files-size", &sst_size);
+            db->GetIntProperty(handles[i], "rocksdb.estimate-live-data-size", &live_size);
+            db->GetIntProperty(handles[i], "rocksdb.estimate-num-keys", &num_keys);
+
+            // a point lookup may read each L0 file and one file in each other non-empty level
+            std::string num_files;
+            for (int level = 0; level < db->NumberLevels(handles[i]); ++level) {
+                if (!db->GetProperty(handles[i], "rocksdb.num-files-at-level" + std::to_string(level), &num_files))
+                    continue;
+                if (level == 0)
+                    l0_files = std::stoull(num_files);
+                else if (std::stoull(num_files))
+                    ++levels;
+            }
+            ilog(
+                "${c}: ${s} MiB on disk, ${l} MiB live, ~${k} keys, read amplification ${r} (${f} L0 files + ${n} levels)",
+                ("c", column_names[i])("s", sst_size >> 20)("l", live_size >> 20)("k", num_keys)("r", l0_files + levels)(
+                    "f", l0_files)("n", levels));
+        }
+    }
 
-        check(rocksdb::DB::Open(options, db_path, &p), "rocksdb::DB::Open: ");
+    static void set_table_options(
+        rocksdb::ColumnFamilyOptions& options, const database_config& config, const std::shared_ptr<rocksdb::Cache>& cache,
+        size_t block_size, bool prefix_seek) {
+        rocksdb::BlockBasedTableOptions table_options;
+        table_options.block_cache                             = cache;
+        table_options.block_size                              = block_size;
+        table_options.cache_index_and_filter_blocks           = true;
+        table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+        table_options.format_version                          = 4;
+        if (config.bloom_bits) {
+            table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(config.bloom_bits, false));
+            table_options.whole_key_filtering = true; // point lookups: get_raw, received_block, fill_status
+            if (prefix_seek) {
+                options.prefix_extractor                 = std::make_shared<key_prefix_extractor>();
+                options.memtable_prefix_bloom_size_ratio = 0.02;
+            }
+        }
+        if (config.partition_filters) {
+            table_options.index_type                                       = rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+            table_options.partition_filters                                = config.bloom_bits != 0;
+            table_options.pin_top_level_index_and_filter                   = true;
+            table_options.cache_index_and_filter_blocks_with_high_priority = true;
+        }
+        options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    }
+
+    void open_from_file(const char* db_path, const std::string& options_file) {
+        rocksdb::DBOptions                           db_options;
+        std::vector<rocksdb::ColumnFamilyDescriptor> cf_descs;
+        check(rocksdb::LoadOptionsFromFile(options_file, rocksdb::Env::Default(), &db_options, &cf_descs), "LoadOptionsFromFile: ");
+        if (cf_descs.empty())
+            throw std::runtime_error(options_file + " has no column family options");
+        ilog("open ${p} with options from ${f}", ("p", db_path)("f", options_file));
+
+        // families missing from the file use the file's first family's options
+        std::vector<rocksdb::ColumnFamilyDescriptor> families;
+        for (auto& name : column_names) {
+            auto it = std::find_if(cf_descs.begin(), cf_descs.end(), [&](auto& d) { return d.name == name; });
+            families.emplace_back(name, it == cf_descs.end() ? cf_descs[0].options : it->options);
+        }
+        open(db_path, db_options, std::move(families));
+    }
+
+    void open(const char* db_path, rocksdb::DBOptions db_options, std::vector<rocksdb::ColumnFamilyDescriptor> families) {
+        db_options.create_if_missing              = true;
+        db_options.create_missing_column_families = true;
+        db_options.atomic_flush                   = true; // writes skip the WAL; a flush must not persist index without content
+        families.emplace_back(rocksdb::kDefaultColumnFamilyName, families[0].options);
+        for (auto c : {column::content, column::index, column::meta})
+            families[size_t(c)].options.compaction_filter_factory =
+                std::make_shared<history_filter_factory>(filter_context, c == column::index);
+
+        rocksdb::DB* p;
+        check(rocksdb::DB::Open(db_options, db_path, families, &handles, &p), "rocksdb::DB::Open: ");
         db.reset(p);
+        filter_context->content = handle(column::content);
+        filter_context->index   = handle(column::index);
+        filter_context->db      = p;
+        load_filter_state();
         ilog("database opened");
     }
 
+    // The filters need the query config to decode rows and index entries; until then they keep everything
+    void set_query_config(const kv::config* config) { filter_context->config = config; }
+
+    void load_filter_state() {
+        auto        state = std::make_shared<history_filter_state>();
+        std::string value;
+        auto        stat = db->Get(rocksdb::ReadOptions(), handle(column::meta), to_slice(kv::make_fork_ranges_key()), &value);
+        if (!stat.IsNotFound()) {
+            check(stat, "load_filter_state: ");
+            abieos::input_buffer bin{value.data(), value.data() + value.size()};
+            state->forks = abieos::bin_to_native<std::vector<kv::fork_range>>(bin);
+        }
+        stat = db->Get(rocksdb::ReadOptions(), handle(column::meta), to_slice(kv::make_trim_block_key()), &value);
+        if (!stat.IsNotFound()) {
+            check(stat, "load_filter_state: ");
+            abieos::input_buffer bin{value.data(), value.data() + value.size()};
+            state->trim_block = abieos::bin_to_native<uint32_t>(bin);
+        }
+        std::atomic_store(&filter_context->state, std::shared_ptr<const history_filter_state>(std::move(state)));
+    }
+
+    // Records blocks whose index entries may be stale. Ranges are merged and kept sorted; the caller writes batch.
+    void add_fork_range(rocksdb::WriteBatch& batch, uint32_t begin_block, uint32_t end_block) {
+        auto state = std::make_shared<history_filter_state>(*std::atomic_load(&filter_context->state));
+        std::vector<kv::fork_range> forks;
+        for (auto& fork : state->forks) {
+            if (fork.end_block + 1 < begin_block || fork.begin_block > end_block + 1) {
+                forks.push_back(fork);
+            } else {
+                begin_block = std::min(begin_block, fork.begin_block);
+                end_block   = std::max(end_block, fork.end_block);
+            }
+        }
+        auto pos = std::find_if(forks.begin(), forks.end(), [&](auto& fork) { return fork.begin_block > begin_block; });
+        forks.insert(pos, kv::fork_range{begin_block, end_block});
+        batch.Put(handle(column::meta), to_slice(kv::make_fork_ranges_key()), to_slice(abieos::native_to_bin(forks)));
+        state->forks = std::move(forks);
+        std::atomic_store(&filter_context->state, std::shared_ptr<const history_filter_state>(std::move(state)));
+    }
+
+    // Lets compaction trim rows older than trim_block; the caller writes batch
+    void set_trim_block(rocksdb::WriteBatch& batch, uint32_t trim_block) {
+        auto state        = std::make_shared<history_filter_state>(*std::atomic_load(&filter_context->state));
+        state->trim_block = trim_block;
+        batch.Put(handle(column::meta), to_slice(kv::make_trim_block_key()), to_slice(abieos::native_to_bin(trim_block)));
+        std::atomic_store(&filter_context->state, std::shared_ptr<const history_filter_state>(std::move(state)));
+    }
+
+    // Databases written before the column family split keep every row in the default family
+    void check_layout(const char* db_path, const database_config& config) {
+        rocksdb::ReadOptions options;
+        options.total_order_seek = true;
+        std::unique_ptr<rocksdb::Iterator> it{db->NewIterator(options, default_handle())};
+        it->SeekToFirst();
+        check(it->status(), "check_layout: ");
+        if (!it->Valid())
+            return;
+        if (!config.migrate)
+            throw std::runtime_error(
+                std::string(db_path) + " uses the old single column family layout; run once with --rdb-migrate to convert it");
+        migrate(*it);
+    }
+
+    // Moves each row from the default family to its own family. Each batch deletes the rows it copies, and is written with
+    // the WAL, so an interrupted migration can be restarted.
+    void migrate(rocksdb::Iterator& it) {
+        ilog("migrating to column families");
+        rocksdb::WriteBatch batch;
+        uint64_t            num_keys = 0;
+        for (; it.Valid(); it.Next()) {
+            batch.Put(handle(it.key()), it.key(), it.value());
+            batch.Delete(default_handle(), it.key());
+            if (!(++num_keys % 100'000)) {
+                check(db->Write(rocksdb::WriteOptions(), &batch), "migrate: ");
+                batch.Clear();
+                ilog("migrated ${n} keys", ("n", num_keys));
+            }
+        }
+        check(it.status(), "migrate: ");
+        check(db->Write(rocksdb::WriteOptions(), &batch), "migrate: ");
+        flush(true, true);
+        check(db->CompactRange(rocksdb::CompactRangeOptions(), default_handle(), nullptr, nullptr), "migrate: ");
+        ilog("migrated ${n} keys", ("n", num_keys));
+    }
+
     database(const database&) = delete;
     database(database&&)      = delete;
     database& operator=(const database&) = delete;
     database& operator=(database&&) = delete;
 
+    ~database() {
+        for (auto* h : handles)
+            db->DestroyColumnFamilyHandle(h);
+    }
+
+    rocksdb::ColumnFamilyHandle* handle(column c) const { return handles[size_t(c)]; }
+    rocksdb::ColumnFamilyHandle* handle(rocksdb::Slice key) const { return handle(column_for(key)); }
+    rocksdb::ColumnFamilyHandle* default_handle() const { return handles.back(); }
+
+    rocksdb::ColumnFamilyHandle* handle_by_id(uint32_t id) const {
+        for (auto* h : handles)
+            if (h->GetID() == id)
+                return h;
+        throw std::runtime_error("unknown column family " + std::to_string(id));
+    }
+
     void flush(bool allow_write_stall, bool wait) {
         rocksdb::FlushOptions op;
         op.allow_write_stall = allow_write_stall;
         op.wait              = wait;
-        db->Flush(op);
+        db->Flush(op, handles);
     }
 };
 
-inline rocksdb::Slice to_slice(const std::vector<char>& v) { return {v.data(), v.size()}; }
+// A point-in-time view of the database. Iterators created from the same snapshot agree with each other, in every column
+// family, even while a filler is writing.
+struct snapshot {
+    database*                db;
+    const rocksdb::Snapshot* snap;
 
-inline rocksdb::Slice to_slice(abieos::input_buffer v) { return {v.pos, size_t(v.end - v.pos)}; }
+    explicit snapshot(database& database)
+        : db(&database)
+        , snap(database.db->GetSnapshot()) {}
 
-inline abieos::input_buffer to_input_buffer(rocksdb::Slice v) { return {v.data(), v.data() + v.size()}; }
+    snapshot(const snapshot&) = delete;
+    snapshot& operator=(const snapshot&) = delete;
 
-inline abieos::input_buffer to_input_buffer(rocksdb::PinnableSlice& v) { return {v.data(), v.data() + v.size()}; }
+    ~snapshot() { db->db->ReleaseSnapshot(snap); }
 
-inline void put(rocksdb::WriteBatch& batch, const std::vector<char>& key, const std::vector<char>& value, bool overwrite = false) {
+    rocksdb::ReadOptions read_options() const {
+        rocksdb::ReadOptions options;
+        options.snapshot = snap;
+        return options;
+    }
+
+    std::unique_ptr<rocksdb::Iterator> new_iterator(column c) const {
+        return std::unique_ptr<rocksdb::Iterator>{db->db->NewIterator(read_options(), db->handle(c))};
+    }
+};
+
+inline void
+put(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& key, const std::vector<char>& value, bool overwrite = false) {
     // !!! remove overwrite
-    batch.Put(to_slice(key), to_slice(value));
+    batch.Put(db.handle(to_slice(key)), to_slice(key), to_slice(value));
 }
 
 template <typename T>
-void put(rocksdb::WriteBatch& batch, const std::vector<char>& key, const T& value, bool overwrite = false) {
-    put(batch, key, abieos::native_to_bin(value), overwrite);
+void put(database& db, rocksdb::WriteBatch& batch, const std::vector<char>& key, const T& value, bool overwrite = false) {
+    put(db, batch, key, abieos::native_to_bin(value), overwrite);
 }
 
+inline void erase(database& db, rocksdb::WriteBatch& batch, rocksdb::Slice key) { batch.Delete(db.handle(key), key); }
+
 inline void write(database& db, rocksdb::WriteBatch& batch) {
     // todo: verify status write order
     rocksdb::WriteOptions opt;
@@ -100,7 +593,7 @@ inline void write(database& db, rocksdb::WriteBatch& batch) {
 
 inline bool exists(database& db, rocksdb::Slice key) {
     rocksdb::PinnableSlice v;
-    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.db->DefaultColumnFamily(), key, &v);
+    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.handle(key), key, &v);
     if (stat.IsNotFound())
         return false;
     check(stat, "exists: ");
@@ -113,6 +606,13 @@ inline std::optional<abieos::input_buffer> get_raw(rocksdb::Iterator& it, const
     if (stat.IsNotFound() && !required)
         return {};
     check(stat, "Seek: ");
+    // the iterator is past the end (or, in prefix mode, the prefix is absent) when key sorts after everything left
+    if (!it.Valid()) {
+        if (required)
+            throw std::runtime_error("key not found");
+        else
+            return {};
+    }
     auto k = it.key();
     if (k.size() != key.size() || memcmp(key.data(), k.data(), key.size())) {
         if (required)
@@ -123,6 +623,15 @@ inline std::optional<abieos::input_buffer> get_raw(rocksdb::Iterator& it, const
     return to_input_buffer(it.value());
 }
 
+// Finds the row an index entry refers to. Stale entries (see index_matches_row) have no row.
+inline std::optional<abieos::input_buffer>
+get_indexed_row(rocksdb::Iterator& it, abieos::input_buffer index_key, const kv::table& table, const kv::index& index) {
+    auto row = get_raw(it, kv::extract_pk_from_index(index_key, table, index.sort_keys), false);
+    if (row && !kv::index_matches_row(index_key, *row, table, index))
+        return {};
+    return row;
+}
+
 template <typename T>
 std::optional<T> get(rocksdb::Iterator& it, const std::vector<char>& key, bool required) {
     auto bin = get_raw(it, key, required);
@@ -135,7 +644,7 @@ std::optional<T> get(rocksdb::Iterator& it, const std::vector<char>& key, bool r
 template <typename T>
 std::optional<T> get(database& db, const std::vector<char>& key, bool required) {
     rocksdb::PinnableSlice v;
-    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.db->DefaultColumnFamily(), to_slice(key), &v);
+    auto                   stat = db.db->Get(rocksdb::ReadOptions(), db.handle(to_slice(key)), to_slice(key), &v);
     if (stat.IsNotFound() && !required)
         return {};
     check(stat, "get: ");
@@ -161,12 +670,25 @@ void for_each(rocksdb::Iterator& it, const std::vector<char>& lower_bound, const
     check(it.status(), "for_each: ");
 }
 
+// Iterator for scans which may cross key prefixes (see key_prefix_extractor)
+inline std::unique_ptr<rocksdb::Iterator> new_total_order_iterator(database& db, column c) {
+    rocksdb::ReadOptions options;
+    options.total_order_seek = true;
+    return std::unique_ptr<rocksdb::Iterator>{db.db->NewIterator(options, db.handle(c))};
+}
+
 template <typename F>
-void for_each(database& db, const std::vector<char>& lower_bound, const std::vector<char>& upper_bound, F f) {
-    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(rocksdb::ReadOptions())};
+void for_each(database& db, column c, const std::vector<char>& lower_bound, const std::vector<char>& upper_bound, F f) {
+    auto it = new_total_order_iterator(db, c);
     for_each(*it, lower_bound, upper_bound, f);
 }
 
+// Scans the column family holding lower_bound
+template <typename F>
+void for_each(database& db, const std::vector<char>& lower_bound, const std::vector<char>& upper_bound, F f) {
+    for_each(db, column_for(to_slice(lower_bound)), lower_bound, upper_bound, f);
+}
+
 // Loop through keys in range [lower_bound, upper_bound], inclusive. Skip keys with duplicate prefix.
 // The prefix is the same size as lower_bound and upper_bound, which must have the same size.
 //
@@ -195,9 +717,93 @@ void for_each_subkey(rocksdb::Iterator& it, std::vector<char> lower_bound, const
 
 template <typename F>
 void for_each_subkey(database& db, std::vector<char> lower_bound, const std::vector<char>& upper_bound, F f) {
-    std::unique_ptr<rocksdb::Iterator> it{db.db->NewIterator(rocksdb::ReadOptions())};
+    auto it = new_total_order_iterator(db, column_for(to_slice(lower_bound)));
     for_each_subkey(*it, std::move(lower_bound), upper_bound, f);
 }
 
+// Bulk loading: the puts in a set of WriteBatches, sorted into one SST file per column family, then ingested in one
+// step. The rows skip the memtables, and files covering new block ranges go straight to the bottommost level. Only puts
+// are supported.
+struct sst_files {
+    std::vector<rocksdb::IngestExternalFileArg> args;
+};
+
+struct batch_puts : rocksdb::WriteBatch::Handler {
+    std::map<uint32_t, std::vector<std::pair<rocksdb::Slice, rocksdb::Slice>>> puts; // by column family id; points into the batches
+
+    rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key, const rocksdb::Slice& value) override {
+        puts[column_family_id].emplace_back(key, value);
+        return rocksdb::Status::OK();
+    }
+
+    rocksdb::Status DeleteCF(uint32_t, const rocksdb::Slice&) override { return rocksdb::Status::NotSupported("bulk load: delete"); }
+};
+
+// SST files waiting for ingest live here, apart from RocksDB's own files. Ingesting moves them out; anything left behind
+// by a process which died before ingesting is never used, so clear_bulk_dir() runs before a filler starts writing.
+inline std::string bulk_dir(const database& db) { return db.path + "/bulk"; }
+
+inline void clear_bulk_dir(const database& db) {
+    boost::filesystem::remove_all(bulk_dir(db));
+    boost::filesystem::create_directories(bulk_dir(db));
+}
+
+// Safe to call from a worker thread. filename_prefix, normally within bulk_dir(), must be unique among files which haven't
+// been ingested yet.
+inline sst_files
+write_sst_files(database& db, const std::vector<const rocksdb::WriteBatch*>& batches, const std::string& filename_prefix) {
+    batch_puts handler;
+    for (auto* batch : batches)
+        check(batch->Iterate(&handler), "write_sst_files: ");
+
+    sst_files result;
+    for (auto& [id, puts] : handler.puts) {
+        auto* h = db.handle_by_id(id);
+
+        // SstFileWriter needs strictly increasing keys; the last put of a key wins, as it would in the batch
+        std::stable_sort(puts.begin(), puts.end(), [](auto& a, auto& b) { return a.first.compare(b.first) < 0; });
+        auto filename = filename_prefix + "-" + h->GetName() + ".sst";
+        rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), rocksdb::Options(db.db->GetDBOptions(), db.db->GetOptions(h)), h);
+        check(writer.Open(filename), "SstFileWriter::Open: ");
+        for (size_t i = 0; i < puts.size(); ++i)
+            if (i + 1 == puts.size() || puts[i].first != puts[i + 1].first)
+                check(writer.Put(puts[i].first, puts[i].second), "SstFileWriter::Put: ");
+        check(writer.Finish(), "SstFileWriter::Finish: ");
+
+        rocksdb::IngestExternalFileArg arg;
+        arg.column_family      = h;
+        arg.external_files     = {filename};
+        arg.options.move_files = true;
+        result.args.push_back(std::move(arg));
+    }
+    return result;
+}
+
+// Ingests every column family's file atomically, so fill_status never becomes visible before the rows it covers
+inline void ingest(database& db, sst_files& files) {
+    if (!files.args.empty())
+        check(db.db->IngestExternalFiles(files.args), "IngestExternalFiles: ");
+}
+
+// Appends the puts in src to dest, keeping their order and column families
+inline void append_puts(database& db, rocksdb::WriteBatch& dest, const rocksdb::WriteBatch& src) {
+    struct handler : rocksdb::WriteBatch::Handler {
+        database&            db;
+        rocksdb::WriteBatch& dest;
+
+        handler(database& db, rocksdb::WriteBatch& dest)
+            : db(db)
+            , dest(dest) {}
+
+        rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key, const rocksdb::Slice& value) override {
+            dest.Put(db.handle_by_id(column_family_id), key, value);
+            return rocksdb::Status::OK();
+        }
+
+        rocksdb::Status DeleteCF(uint32_t, const rocksdb::Slice&) override { return rocksdb::Status::NotSupported("append_puts: delete"); }
+    } h{db, dest};
+    check(src.Iterate(&h), "append_puts: ");
+}
+
 } // namespace rdb
 } // namespace state_history
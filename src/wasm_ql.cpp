@@ -2,20 +2,36 @@
 
 #include "wasm_ql.hpp"
 
+#include <boost/filesystem.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/scoped_exit.hpp>
 
+#include <atomic>
+#include <future>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
 using namespace abieos::literals;
 
 namespace wasm_ql {
 
 struct callbacks;
-using backend_t = eosio::vm::backend<callbacks>;
-using rhf_t     = eosio::vm::registered_host_functions<callbacks>;
+using rhf_t        = eosio::vm::registered_host_functions<callbacks>;
+using global_value = std::decay_t<decltype(std::declval<eosio::vm::module&>().globals[0].current)>;
+
+// A parsed module bound to one of eos-vm's execution modes
+struct vm_instance {
+    virtual ~vm_instance() {}
+    virtual eosio::vm::module& get_module()                                                            = 0;
+    virtual void               initialize(callbacks& cb)                                               = 0;
+    virtual void               call(callbacks& cb, const char* name)                                   = 0;
+    virtual uint32_t           call_table(callbacks& cb, uint32_t index, uint32_t arg0, uint32_t arg1) = 0;
+};
 
 struct callbacks {
     wasm_ql::thread_state& thread_state;
-    backend_t&             backend;
+    vm_instance&           vm;
 
     void check_bounds(const char* begin, const char* end) {
         if (begin > end)
@@ -25,11 +41,7 @@ struct callbacks {
 
     char* alloc(uint32_t cb_alloc_data, uint32_t cb_alloc, uint32_t size) {
         // todo: verify cb_alloc isn't in imports
-        auto result = backend.get_context().execute_func_table(
-            this, eosio::vm::interpret_visitor(backend.get_context()), cb_alloc, cb_alloc_data, size);
-        if (!result || !result->is_a<eosio::vm::i32_const_t>())
-            throw std::runtime_error("cb_alloc returned incorrect type");
-        char* begin = thread_state.wa.get_base_ptr<char>() + result->to_ui32();
+        char* begin = thread_state.wa.get_base_ptr<char>() + vm.call_table(*this, cb_alloc, cb_alloc_data, size);
         check_bounds(begin, begin + size);
         return begin;
     }
@@ -83,6 +95,254 @@ void register_callbacks() {
     rhf_t::add<callbacks, &callbacks::print_range, eosio::vm::wasm_allocator>("env", "print_range");
 }
 
+template <typename Impl>
+struct visitor_for;
+
+template <>
+struct visitor_for<eosio::vm::interpreter> {
+    template <typename Context>
+    static auto make(Context& context) {
+        return eosio::vm::interpret_visitor(context);
+    }
+};
+
+#ifdef __x86_64__
+template <>
+struct visitor_for<eosio::vm::jit> {
+    template <typename Context>
+    static auto make(Context& context) {
+        return eosio::vm::jit_visitor(context);
+    }
+};
+#endif
+
+template <typename Impl>
+struct vm_instance_impl : vm_instance {
+    eosio::vm::backend<callbacks, Impl> backend;
+
+    // the jit backend compiles here; the result lives as long as this instance
+    vm_instance_impl(std::vector<uint8_t>& code, eosio::vm::wasm_allocator& wa)
+        : backend(code) {
+        backend.set_wasm_allocator(&wa);
+        rhf_t::resolve(backend.get_module());
+    }
+
+    eosio::vm::module& get_module() override { return backend.get_module(); }
+    void               initialize(callbacks& cb) override { backend.initialize(&cb); }
+    void               call(callbacks& cb, const char* name) override { backend(&cb, "env", name); }
+
+    uint32_t call_table(callbacks& cb, uint32_t index, uint32_t arg0, uint32_t arg1) override {
+        auto& context = backend.get_context();
+        auto  result  = context.execute_func_table(&cb, visitor_for<Impl>::make(context), index, arg0, arg1);
+        if (!result || !result->template is_a<eosio::vm::i32_const_t>())
+            throw std::runtime_error("cb_alloc returned incorrect type");
+        return result->to_ui32();
+    }
+};
+
+static std::unique_ptr<vm_instance> create_vm_instance(vm_type vm, std::vector<uint8_t>& code, eosio::vm::wasm_allocator& wa) {
+    switch (vm) {
+    case vm_type::interpreter: return std::make_unique<vm_instance_impl<eosio::vm::interpreter>>(code, wa);
+#ifdef __x86_64__
+    case vm_type::jit: return std::make_unique<vm_instance_impl<eosio::vm::jit>>(code, wa);
+#endif
+    default: throw std::runtime_error("unsupported vm type");
+    }
+}
+
+// Linear memory and globals as they were immediately after backend.initialize(). On Linux the memory
+// is kept in a memfd which is mapped copy-on-write over linear memory; restoring only discards the
+// pages the previous request dirtied. Elsewhere it falls back to memcpy.
+struct memory_image {
+    int32_t                   pages   = 0;
+    int                       fd      = -1;
+    std::vector<char>         data    = {};
+    std::vector<global_value> globals = {};
+
+    memory_image()                    = default;
+    memory_image(const memory_image&) = delete;
+    ~memory_image() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    memory_image& operator=(const memory_image&) = delete;
+
+    void capture(vm_instance& vm, eosio::vm::wasm_allocator& wa) {
+        pages     = wa.get_current_page();
+        auto size = size_t(pages) * eosio::vm::page_size;
+        auto base = wa.get_base_ptr<char>();
+#ifdef __linux__
+        fd = memfd_create("wasm-ql-image", MFD_CLOEXEC);
+        if (fd >= 0) {
+            size_t pos = 0;
+            while (pos < size) {
+                auto n = ::write(fd, base + pos, size - pos);
+                if (n <= 0)
+                    break;
+                pos += n;
+            }
+            if (pos != size) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+#endif
+        if (fd < 0)
+            data.assign(base, base + size);
+        auto& mod_globals = vm.get_module().globals;
+        globals.clear();
+        for (size_t i = 0; i < mod_globals.size(); ++i)
+            globals.push_back(mod_globals[i].current);
+        map(wa);
+    }
+
+    void restore(vm_instance& vm, eosio::vm::wasm_allocator& wa) {
+        // memory is shared by all instances on this thread, so another module may have resized it
+        if (wa.get_current_page() != pages)
+            wa.reset(pages);
+        map(wa);
+        auto& mod_globals = vm.get_module().globals;
+        for (size_t i = 0; i < mod_globals.size(); ++i)
+            mod_globals[i].current = globals[i];
+    }
+
+  private:
+    void map(eosio::vm::wasm_allocator& wa) {
+        auto size = size_t(pages) * eosio::vm::page_size;
+        auto base = wa.get_base_ptr<char>();
+        if (!size)
+            return;
+        if (fd >= 0) {
+            if (::mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+                throw std::runtime_error("mmap of memory image failed");
+        } else {
+            memcpy(base, data.data(), size);
+        }
+    }
+};
+
+// A backend parsed from a module_cache entry. Only the thread which owns it may use it.
+struct instance {
+    std::shared_ptr<const module_cache::entry> module  = {};
+    std::vector<uint8_t>                       code    = {};
+    std::unique_ptr<vm_instance>               vm      = {};
+    std::unique_ptr<memory_image>              image   = {}; // empty until the first initialize()
+};
+
+struct instances {
+    std::map<abieos::name, instance> by_name = {};
+};
+
+std::shared_ptr<const module_cache::entry> module_cache::get(const std::string& wasm_dir, abieos::name short_name) {
+    auto path  = wasm_dir + "/" + (std::string)short_name + "-server.wasm";
+    auto mtime = boost::filesystem::last_write_time(path);
+    auto size  = boost::filesystem::file_size(path);
+    {
+        std::shared_lock lock{mutex};
+        auto             it = entries.find(short_name);
+        if (it != entries.end() && it->second->path == path && it->second->mtime == mtime && it->second->size == size)
+            return it->second;
+    }
+
+    auto result   = std::make_shared<entry>();
+    result->path  = path;
+    result->mtime = mtime;
+    result->size  = size;
+    result->code  = std::make_shared<const std::vector<uint8_t>>(eosio::vm::backend<callbacks>::read_wasm(path));
+
+    std::unique_lock lock{mutex};
+    auto&            existing = entries[short_name];
+    if (existing && existing->path == path && existing->mtime == mtime && existing->size == size)
+        return existing;
+    ilog("loaded ${p}", ("p", path));
+    existing = result;
+    return result;
+}
+
+// The cache only holds replies for one fill_status (see observe), so the key doesn't need it
+static std::string make_response_key(const std::string& target, const std::vector<char>& request) {
+    std::string key;
+    key.reserve(target.size() + 1 + request.size());
+    key.append(target);
+    key.push_back(0);
+    key.append(request.data(), request.size());
+    return key;
+}
+
+// Caller must hold mutex
+void response_cache::observe(const state_history::fill_status& status) {
+    if (status.head < seen.head || status == seen)
+        return;
+    seen = status;
+    lru.clear();
+    by_key.clear();
+    bytes = 0;
+}
+
+// Caller must hold mutex
+void response_cache::erase(std::list<entry>::iterator it) {
+    bytes -= it->key.size() + it->reply.size();
+    by_key.erase(it->key);
+    lru.erase(it);
+}
+
+std::optional<std::vector<char>>
+response_cache::get(const std::string& target, const std::vector<char>& request, const state_history::fill_status& status) {
+    auto             key = make_response_key(target, request);
+    std::scoped_lock lock{mutex};
+    observe(status);
+    if (!((hits + misses + 1) % 10'000))
+        ilog(
+            "response cache: ${h} hits, ${m} misses, ${n} entries, ${b} bytes",
+            ("h", hits)("m", misses)("n", lru.size())("b", bytes));
+    auto it = status == seen ? by_key.find(key) : by_key.end();
+    if (it == by_key.end()) {
+        ++misses;
+        return {};
+    }
+    ++hits;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->reply;
+}
+
+void response_cache::put(
+    const std::string& target, const std::vector<char>& request, const state_history::fill_status& status,
+    const std::vector<char>& reply) {
+    auto key  = make_response_key(target, request);
+    auto size = key.size() + reply.size();
+    if (size > max_bytes)
+        return;
+    std::scoped_lock lock{mutex};
+    observe(status);
+    if (status != seen)
+        return; // superseded while the query ran
+    if (auto it = by_key.find(key); it != by_key.end())
+        erase(it->second);
+    lru.push_front(entry{std::move(key), reply});
+    by_key[lru.front().key] = lru.begin();
+    bytes += size;
+    while (bytes > max_bytes)
+        erase(std::prev(lru.end()));
+}
+
+// Parsing, validating, resolving imports, and jit compiling happen once per thread per version of the file
+static instance& get_instance(wasm_ql::thread_state& thread_state, abieos::name short_name) {
+    auto module = thread_state.shared->modules->get(thread_state.shared->wasm_dir, short_name);
+    if (!thread_state.instances)
+        thread_state.instances = std::make_shared<instances>();
+    auto& inst = thread_state.instances->by_name[short_name];
+    if (inst.module != module) {
+        inst.image.reset();
+        inst.vm.reset();
+        inst.module = {};
+        inst.code   = *module->code;
+        inst.vm     = create_vm_instance(thread_state.shared->vm, inst.code, thread_state.wa);
+        inst.module = std::move(module);
+    }
+    return inst;
+}
+
 static void fill_context_data(wasm_ql::thread_state& thread_state) {
     thread_state.database_status.clear();
     abieos::native_to_bin(thread_state.fill_status.head, thread_state.database_status);
@@ -94,6 +354,8 @@ static void fill_context_data(wasm_ql::thread_state& thread_state) {
 
 // todo: detect thread_state.fill_status.first changing (history trim)
 static bool did_fork(wasm_ql::thread_state& thread_state) {
+    if (thread_state.fill_status.head <= thread_state.fill_status.irreversible)
+        return false; // irreversible blocks don't fork
     auto id = thread_state.query_session->get_block_id(thread_state.fill_status.head);
     if (!id) {
         ilog("fork detected (prev head not found)");
@@ -125,39 +387,127 @@ static void retry_loop(wasm_ql::thread_state& thread_state, F f) {
 }
 
 static void run_query(wasm_ql::thread_state& thread_state, abieos::name short_name) {
-    auto      code = backend_t::read_wasm(thread_state.shared->wasm_dir + "/" + (std::string)short_name + "-server.wasm");
-    backend_t backend(code);
-    callbacks cb{thread_state, backend};
-    backend.set_wasm_allocator(&thread_state.wa);
+    auto&     inst = get_instance(thread_state, short_name);
+    callbacks cb{thread_state, *inst.vm};
 
-    rhf_t::resolve(backend.get_module());
-    backend.initialize(&cb);
-    backend(&cb, "env", "initialize");
-    backend(&cb, "env", "run_query");
+    if (inst.image) {
+        inst.image->restore(*inst.vm, thread_state.wa);
+    } else {
+        inst.vm->initialize(cb);
+        inst.image = std::make_unique<memory_image>();
+        inst.image->capture(*inst.vm, thread_state.wa);
+    }
+    inst.vm->call(cb, "initialize");
+    inst.vm->call(cb, "run_query");
+}
+
+// Runs request on thread_state, which must already have a query_session, and leaves the reply in thread_state.reply
+static void run_sub_query(wasm_ql::thread_state& thread_state, abieos::input_buffer request) {
+    thread_state.request = request;
+    auto ns_name         = abieos::bin_to_native<abieos::name>(thread_state.request);
+    if (ns_name != "local"_n)
+        throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
+    auto short_name = abieos::bin_to_native<abieos::name>(thread_state.request);
+    run_query(thread_state, short_name);
 }
 
+struct sub_query {
+    abieos::input_buffer request = {};
+    std::vector<char>    reply   = {};
+    std::atomic<bool>    claimed = false;
+    std::promise<void>   done    = {};
+    std::future<void>    ready   = done.get_future();
+};
+
+// The sub-queries of one query() request. Sub-queries which other threads pick up run in sessions shared from the
+// requester's (query_session::share), against the requester's fill_status, so every sub-query reads the same head block
+// the requester does. Whichever thread claims a sub-query first runs it; the requesting thread claims the ones nobody has
+// started, so it never waits for a sub-query that's stuck in the queue.
+struct sub_query_batch {
+    state_history::fill_status fill_status;
+    query_session*             source;
+    std::vector<sub_query>     queries;
+
+    sub_query_batch(const state_history::fill_status& fill_status, query_session& source, uint32_t num_queries)
+        : fill_status(fill_status)
+        , source(&source)
+        , queries(num_queries) {}
+
+    // on another thread
+    void run_posted(wasm_ql::thread_state& thread_state, uint32_t i) {
+        auto& q = queries[i];
+        if (q.claimed.exchange(true))
+            return;
+        try {
+            auto exit                  = fc::make_scoped_exit([&] { thread_state.query_session.reset(); });
+            thread_state.query_session = source->share();
+            thread_state.fill_status   = fill_status;
+            fill_context_data(thread_state);
+            run_sub_query(thread_state, q.request);
+            q.reply = thread_state.reply;
+            q.done.set_value();
+        } catch (...) {
+            q.done.set_exception(std::current_exception());
+        }
+    }
+
+    // on the requesting thread, within retry_loop. Posted sub-queries use the requester's session, so this waits for every
+    // one that started, even after a failure, before it rethrows.
+    void run_all(wasm_ql::thread_state& thread_state) {
+        std::exception_ptr error;
+        for (auto& q : queries) {
+            try {
+                if (q.claimed.exchange(true)) {
+                    q.ready.get();
+                } else if (!error) {
+                    run_sub_query(thread_state, q.request);
+                    q.reply = thread_state.reply;
+                }
+            } catch (...) {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
 std::vector<char> query(wasm_ql::thread_state& thread_state, const std::vector<char>& request) {
-    std::vector<char> result;
+    static const std::string target = "/wasmql/v1/query";
+    auto*                    cache  = thread_state.shared->responses.get();
+    std::vector<char>        result;
     retry_loop(thread_state, [&]() {
+        if (cache) {
+            if (auto reply = cache->get(target, request, thread_state.fill_status)) {
+                result = std::move(*reply);
+                return true;
+            }
+        }
         abieos::input_buffer request_bin{request.data(), request.data() + request.size()};
         auto                 num_requests = abieos::bin_to_native<abieos::varuint32>(request_bin).value;
+        auto                 batch =
+            std::make_shared<sub_query_batch>(thread_state.fill_status, *thread_state.query_session, num_requests);
+        for (auto& q : batch->queries)
+            q.request = abieos::bin_to_native<abieos::input_buffer>(request_bin);
+
+        // the batch outlives this call if the requesting thread finishes while a posted sub-query is still queued
+        for (uint32_t i = 1; i < num_requests && thread_state.post; ++i)
+            if (!thread_state.post([batch, i](wasm_ql::thread_state& other) { batch->run_posted(other, i); }))
+                break;
+        batch->run_all(thread_state);
+        if (did_fork(thread_state))
+            return false;
+
         result.clear();
         abieos::push_varuint32(result, num_requests);
-        for (uint32_t request_index = 0; request_index < num_requests; ++request_index) {
-            thread_state.request = abieos::bin_to_native<abieos::input_buffer>(request_bin);
-            auto ns_name         = abieos::bin_to_native<abieos::name>(thread_state.request);
-            if (ns_name != "local"_n)
-                throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
-            auto short_name = abieos::bin_to_native<abieos::name>(thread_state.request);
-
-            run_query(thread_state, short_name);
-            if (did_fork(thread_state))
-                return false;
-
-            // elog("result: ${s} ${x}", ("s", thread_state.reply.size())("x", fc::to_hex(thread_state.reply)));
-            abieos::push_varuint32(result, thread_state.reply.size());
-            result.insert(result.end(), thread_state.reply.begin(), thread_state.reply.end());
+        for (auto& q : batch->queries) {
+            // elog("result: ${s} ${x}", ("s", q.reply.size())("x", fc::to_hex(q.reply)));
+            abieos::push_varuint32(result, q.reply.size());
+            result.insert(result.end(), q.reply.begin(), q.reply.end());
         }
+        if (cache)
+            cache->put(target, request, thread_state.fill_status, result);
         return true;
     });
     return result;
@@ -168,9 +518,20 @@ const std::vector<char>& legacy_query(wasm_ql::thread_state& thread_state, const
     abieos::native_to_bin(target, req);
     abieos::native_to_bin(request, req);
     thread_state.request = abieos::input_buffer{req.data(), req.data() + req.size()};
+    auto* cache          = thread_state.shared->responses.get();
     retry_loop(thread_state, [&]() {
+        if (cache) {
+            if (auto reply = cache->get(target, request, thread_state.fill_status)) {
+                thread_state.reply = std::move(*reply);
+                return true;
+            }
+        }
         run_query(thread_state, "legacy"_n);
-        return !did_fork(thread_state);
+        if (did_fork(thread_state))
+            return false;
+        if (cache)
+            cache->put(target, request, thread_state.fill_status, thread_state.reply);
+        return true;
     });
     return thread_state.reply;
 }
@@ -5,24 +5,98 @@
 
 #include <eosio/vm/backend.hpp>
 
+#include <functional>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
 namespace wasm_ql {
 
+struct instances;
+
+enum class vm_type {
+    interpreter,
+    jit,
+};
+
+// Query WASMs, shared by all threads. An entry is reloaded when its file's mtime or size changes.
+class module_cache {
+  public:
+    struct entry {
+        std::string                                 path  = {};
+        std::time_t                                 mtime = {};
+        uintmax_t                                   size  = {};
+        std::shared_ptr<const std::vector<uint8_t>> code  = {};
+    };
+
+    std::shared_ptr<const entry> get(const std::string& wasm_dir, abieos::name short_name);
+
+  private:
+    std::shared_mutex                                    mutex   = {};
+    std::map<abieos::name, std::shared_ptr<const entry>> entries = {};
+};
+
+// Replies to identical requests (same target and body) made against the same fill_status. Replies embed the whole
+// fill_status (see fill_context_data), not just the head, so the whole cache is dropped once a different fill_status is
+// seen. Until then entries stay until they're the least recently used and the cache is over max_bytes.
+class response_cache {
+  public:
+    explicit response_cache(size_t max_bytes)
+        : max_bytes(max_bytes) {}
+
+    std::optional<std::vector<char>>
+    get(const std::string& target, const std::vector<char>& request, const state_history::fill_status& status);
+
+    void put(
+        const std::string& target, const std::vector<char>& request, const state_history::fill_status& status,
+        const std::vector<char>& reply);
+
+  private:
+    struct entry {
+        std::string       key   = {};
+        std::vector<char> reply = {};
+    };
+
+    std::mutex                                                       mutex     = {};
+    size_t                                                           max_bytes = {};
+    size_t                                                           bytes     = {};
+    state_history::fill_status                                       seen      = {}; // newest seen
+    std::list<entry>                                                 lru       = {}; // most recently used first
+    std::unordered_map<std::string_view, std::list<entry>::iterator> by_key    = {}; // points into lru
+    uint64_t                                                         hits      = {};
+    uint64_t                                                         misses    = {};
+
+    void observe(const state_history::fill_status& status);
+    void erase(std::list<entry>::iterator it);
+};
+
 struct shared_state {
     bool                                console      = {};
     std::string                         allow_origin = {};
     std::string                         wasm_dir     = {};
     std::string                         static_dir   = {};
+    vm_type                             vm           = vm_type::interpreter;
     std::shared_ptr<database_interface> db_iface     = {};
+    std::shared_ptr<module_cache>       modules      = std::make_shared<module_cache>();
+    std::shared_ptr<response_cache>     responses    = {}; // null if disabled
 };
 
+struct thread_state;
+
+// Runs work on another thread, with that thread's state. Returns false if no thread is available.
+using post_work = std::function<bool(std::function<void(thread_state&)>)>;
+
 struct thread_state {
     std::shared_ptr<const shared_state> shared          = {};
     eosio::vm::wasm_allocator           wa              = {};
+    std::shared_ptr<wasm_ql::instances> instances       = {}; // parsed backends owned by this thread
     std::vector<char>                   database_status = {};
     abieos::input_buffer                request         = {}; // todo: rename
     std::vector<char>                   reply           = {}; // todo: rename
     std::unique_ptr<::query_session>    query_session   = {};
     state_history::fill_status          fill_status     = {};
+    post_work                           post            = {}; // empty if sub-queries run one at a time
 };
 
 void                     register_callbacks();
@@ -10,6 +10,8 @@
 #include "wasm_ql_http.hpp"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
@@ -22,6 +24,7 @@
 #include <fc/log/logger.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
@@ -39,34 +42,75 @@ using namespace std::literals;
 
 namespace wasm_ql {
 
-class thread_state_cache {
+// Runs queries off the io threads, so a slow query doesn't stall the connections sharing its io thread. Queries beyond
+// max_queued waiting for a thread are refused instead of building an unbounded backlog.
+//
+// Each thread owns one thread_state for its lifetime, so handing a state to a query takes no lock and the number of wasm
+// allocators is fixed at num_threads.
+class query_executor {
   private:
-    std::mutex                                   mutex;
-    std::shared_ptr<const wasm_ql::shared_state> shared_state;
-    std::vector<std::unique_ptr<thread_state>>   states;
+    net::io_context                                          ioc;
+    net::executor_work_guard<net::io_context::executor_type> work = net::make_work_guard(ioc);
+    std::vector<std::unique_ptr<thread_state>>               states;
+    std::vector<std::thread>                                 threads;
+    std::atomic<uint32_t>                                    num_queued{0};
+    uint32_t                                                 max_queued;
+
+    inline static thread_local thread_state* current_state = nullptr;
 
   public:
-    thread_state_cache(const std::shared_ptr<const wasm_ql::shared_state>& shared_state)
-        : shared_state(shared_state) {}
-
-    std::unique_ptr<thread_state> get_state() {
-        std::lock_guard<std::mutex> lock{mutex};
-        if (states.empty()) {
-            auto result    = std::make_unique<thread_state>();
-            result->shared = shared_state;
-            return result;
+    query_executor(int num_threads, uint32_t max_queued, const std::shared_ptr<const shared_state>& shared_state)
+        : max_queued(max_queued) {
+        for (int i = 0; i < num_threads; ++i) {
+            states.push_back(std::make_unique<thread_state>());
+            states.back()->shared = shared_state;
+            states.back()->post   = [this](std::function<void(thread_state&)> f) { return try_post(std::move(f)); };
+        }
+        for (auto& state : states) {
+            threads.emplace_back([this, state = state.get()] {
+                current_state = state;
+                ioc.run();
+            });
         }
-        auto result = std::move(states.back());
-        states.pop_back();
-        return result;
     }
 
-    void store_state(std::unique_ptr<thread_state> state) {
-        std::lock_guard<std::mutex> lock{mutex};
-        states.push_back(std::move(state));
+    // f is called with the thread_state of the thread running it
+    template <typename F>
+    bool try_post(F f) {
+        if (num_queued.fetch_add(1) >= max_queued) {
+            --num_queued;
+            return false;
+        }
+        net::post(ioc, [this, f = std::move(f)]() mutable {
+            --num_queued;
+            f(*current_state);
+        });
+        return true;
+    }
+
+    void stop() {
+        work.reset();
+        ioc.stop();
+        for (auto& t : threads)
+            t.join();
+        threads.clear();
     }
 };
 
+static bool is_query(beast::string_view target) { return target == "/wasmql/v1/query" || target.starts_with("/v1/"); }
+
+template <class Body, class Allocator>
+http::response<http::string_body> busy_response(const http::request<Body, http::basic_fields<Allocator>>& req) {
+    http::response<http::string_body> res{http::status::service_unavailable, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.set(http::field::retry_after, "1");
+    res.keep_alive(req.keep_alive());
+    res.body() = "server busy\n";
+    res.prepare_payload();
+    return res;
+}
+
 // Report a failure
 static void fail(beast::error_code ec, const char* what) { elog("${w}: ${s}", ("w", what)("s", ec.message())); }
 
@@ -153,10 +197,12 @@ std::string path_cat(beast::string_view base, beast::string_view path) {
 // request. The type of the response object depends on the
 // contents of the request, so the interface requires the
 // caller to pass a generic lambda for receiving the response.
+// thread_state is null on the io threads, which never see query
+// targets (see http_session::execute_query).
 template <class Body, class Allocator, class Send>
 void handle_request(
     beast::string_view doc_root, const std::shared_ptr<const shared_state>& shared_state,
-    const std::shared_ptr<thread_state_cache>& state_cache, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
+    wasm_ql::thread_state* thread_state, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
     // Returns a bad request response
     const auto bad_request = [&req](beast::string_view why) {
         http::response<http::string_body> res{http::status::bad_request, req.version()};
@@ -206,19 +252,13 @@ void handle_request(
         if (req.target() == "/wasmql/v1/query") {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
-            send(ok(query(*thread_state, req.body()), "application/octet-stream"));
-            state_cache->store_state(std::move(thread_state));
-            return;
+            return send(ok(query(*thread_state, req.body()), "application/octet-stream"));
         } else if (req.target().starts_with("/v1/")) {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
             std::string s(req.body().begin(), req.body().end());
             ilog("query : ${a} : ${b}", ("a", req.target().to_string()) ("b", s));
-            send(ok(legacy_query(*thread_state, req.target().to_string(), req.body()), "application/octet-stream"));
-            state_cache->store_state(std::move(thread_state));
-            return;
+            return send(ok(legacy_query(*thread_state, req.target().to_string(), req.body()), "application/octet-stream"));
         } else if (doc_root.empty()) {
             return send(error(http::status::not_found, "The resource '" + req.target().to_string() + "' was not found.\n"));
         } else {
@@ -349,7 +389,7 @@ class http_session : public std::enable_shared_from_this<http_session> {
     beast::flat_buffer                  buffer_;
     std::shared_ptr<const std::string>  doc_root_;
     std::shared_ptr<const shared_state> shared_state_;
-    std::shared_ptr<thread_state_cache> state_cache_;
+    std::shared_ptr<query_executor>     executor_;
     queue                               queue_;
 
     // The parser is stored in an optional container so we can
@@ -360,11 +400,11 @@ class http_session : public std::enable_shared_from_this<http_session> {
     // Take ownership of the socket
     http_session(
         tcp::socket&& socket, const std::shared_ptr<const std::string>& doc_root, const std::shared_ptr<const shared_state>& shared_state,
-        const std::shared_ptr<thread_state_cache>& state_cache)
+        const std::shared_ptr<query_executor>& executor)
         : stream_(std::move(socket))
         , doc_root_(doc_root)
         , shared_state_(shared_state)
-        , state_cache_(state_cache)
+        , executor_(executor)
         , queue_(*this) {}
 
     // Start the session
@@ -396,14 +436,37 @@ class http_session : public std::enable_shared_from_this<http_session> {
         if (ec)
             return fail(ec, "read");
 
+        if (is_query(parser_->get().target()))
+            return execute_query();
+
         // Send the response
-        handle_request(*doc_root_, shared_state_, state_cache_, parser_->release(), queue_);
+        handle_request(*doc_root_, shared_state_, nullptr, parser_->release(), queue_);
 
         // If we aren't at the queue limit, try to pipeline another request
         if (!queue_.is_full())
             do_read();
     }
 
+    // Runs the query on the executor and queues the response from this session's strand. Responses must go out in request
+    // order, so the next request isn't read until then.
+    void execute_query() {
+        auto req    = std::make_shared<http::request<http::vector_body<char>>>(parser_->release());
+        bool posted = executor_->try_post([self = shared_from_this(), req](wasm_ql::thread_state& thread_state) {
+            handle_request(*self->doc_root_, self->shared_state_, &thread_state, std::move(*req), [&self](auto&& msg) {
+                net::post(self->stream_.get_executor(), [self, msg = std::move(msg)]() mutable { self->on_query_done(std::move(msg)); });
+            });
+        });
+        if (!posted)
+            on_query_done(busy_response(*req));
+    }
+
+    template <class Msg>
+    void on_query_done(Msg&& msg) {
+        queue_(std::move(msg));
+        if (!queue_.is_full())
+            do_read();
+    }
+
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
@@ -438,17 +501,17 @@ class listener : public std::enable_shared_from_this<listener> {
     tcp::acceptor                       acceptor_;
     std::shared_ptr<const std::string>  doc_root_;
     std::shared_ptr<const shared_state> shared_state_;
-    std::shared_ptr<thread_state_cache> state_cache_;
+    std::shared_ptr<query_executor>     executor_;
 
   public:
     listener(
         net::io_context& ioc, tcp::endpoint endpoint, const std::shared_ptr<const std::string>& doc_root,
-        const std::shared_ptr<const shared_state>& shared_state)
+        const std::shared_ptr<const shared_state>& shared_state, const std::shared_ptr<query_executor>& executor)
         : ioc_(ioc)
         , acceptor_(net::make_strand(ioc))
         , doc_root_(doc_root)
         , shared_state_(shared_state)
-        , state_cache_(std::make_shared<thread_state_cache>(shared_state_)) {
+        , executor_(executor) {
 
         beast::error_code ec;
 
@@ -495,7 +558,7 @@ class listener : public std::enable_shared_from_this<listener> {
             fail(ec, "accept");
         } else {
             // Create the http session and run it
-            std::make_shared<http_session>(std::move(socket), doc_root_, shared_state_, state_cache_)->run();
+            std::make_shared<http_session>(std::move(socket), doc_root_, shared_state_, executor_)->run();
         }
 
         // Accept another connection
@@ -506,15 +569,19 @@ class listener : public std::enable_shared_from_this<listener> {
 struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
     int                                 num_threads;
     net::io_service                     ioc;
+    std::shared_ptr<query_executor>     executor;
     std::shared_ptr<const shared_state> state    = {};
     std::string                         address  = {};
     std::string                         port     = {};
     std::vector<std::thread>            threads  = {};
     std::unique_ptr<tcp::acceptor>      acceptor = {};
 
-    server_impl(int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port)
+    server_impl(
+        int num_threads, int num_exec_threads, uint32_t max_queued, const std::shared_ptr<const shared_state>& state,
+        const std::string& address, const std::string& port)
         : num_threads{num_threads}
         , ioc{num_threads}
+        , executor{std::make_shared<query_executor>(num_exec_threads, max_queued, state)}
         , state{state}
         , address{address}
         , port{port} {}
@@ -526,6 +593,7 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
         for (auto& t : threads)
             t.join();
         threads.clear();
+        executor->stop();
     }
 
     void start() {
@@ -545,7 +613,8 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
             throw std::runtime_error("make_address(): "s + address + ": " + e.what());
         }
         std::make_shared<listener>(
-            ioc, tcp::endpoint{a, (unsigned short)std::atoi(port.c_str())}, std::make_shared<std::string>(state->static_dir), state)
+            ioc, tcp::endpoint{a, (unsigned short)std::atoi(port.c_str())}, std::make_shared<std::string>(state->static_dir), state,
+            executor)
             ->run();
 
         threads.reserve(num_threads);
@@ -555,9 +624,11 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
 }; // server_impl
 
 std::shared_ptr<http_server> http_server::create(
-    int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port) {
+    int num_threads, int num_exec_threads, uint32_t max_queued, const std::shared_ptr<const shared_state>& state,
+    const std::string& address, const std::string& port) {
     FC_ASSERT(num_threads > 0, "too few threads");
-    auto server = std::make_shared<server_impl>(num_threads, state, address, port);
+    FC_ASSERT(num_exec_threads > 0, "too few query threads");
+    auto server = std::make_shared<server_impl>(num_threads, num_exec_threads, max_queued, state, address, port);
     server->start();
     return server;
 }
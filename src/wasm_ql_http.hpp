@@ -8,8 +8,11 @@ namespace wasm_ql {
 struct http_server {
     virtual ~http_server() {}
 
-    static std::shared_ptr<http_server> create( //
-        int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port);
+    // num_threads handle connections; queries run on num_exec_threads others. Queries beyond max_queued waiting for an
+    // executor thread get 503.
+    static std::shared_ptr<http_server> create(
+        int num_threads, int num_exec_threads, uint32_t max_queued, const std::shared_ptr<const shared_state>& state,
+        const std::string& address, const std::string& port);
 
     virtual void stop() = 0;
 };
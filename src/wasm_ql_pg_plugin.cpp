@@ -4,105 +4,321 @@
 #include "state_history_pg.hpp"
 #include "util.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <fc/exception/exception.hpp>
+#include <mutex>
+#include <set>
+#include <thread>
 
 using namespace appbase;
+using namespace std::literals;
 namespace pg = state_history::pg;
 
 static abstract_plugin& _wasm_ql_pg_plugin = app().register_plugin<wasm_ql_pg_plugin>();
 
+// One backend connection: a libpq one with --wpg-binary-results (libpqxx only requests text results), else a libpqxx one
+struct pg_connection {
+    std::optional<pqxx::connection>       sql_connection = {};
+    std::chrono::steady_clock::time_point created        = std::chrono::steady_clock::now();
+    std::set<abieos::name>                prepared       = {}; // queries prepared on this connection
+    pg::pg_conn_ptr                       raw            = {};
+
+    explicit pg_connection(bool binary) {
+        if (binary) {
+            raw.reset(PQconnectdb(""));
+            if (PQstatus(raw.get()) != CONNECTION_OK)
+                throw pqxx::broken_connection(PQerrorMessage(raw.get()));
+        } else {
+            sql_connection.emplace();
+        }
+    }
+
+    bool is_open() const { return sql_connection ? sql_connection->is_open() : PQstatus(raw.get()) == CONNECTION_OK; }
+};
+
+// Bounded set of persistent connections. acquire() blocks while all connections are leased.
+//
+// is_open() only reflects local state; after a server restart every idle connection still claims to be open. So once any
+// connection breaks, every connection opened before then is treated as broken too and replaced when next acquired.
+class pg_connection_pool {
+  private:
+    std::mutex                                  mutex        = {};
+    std::condition_variable                     cv           = {};
+    std::vector<std::unique_ptr<pg_connection>> idle         = {};
+    uint32_t                                    num_open     = 0;
+    std::chrono::steady_clock::time_point       last_failure = {};
+
+  public:
+    bool                      binary       = false;
+    uint32_t                  max_size     = 8;
+    std::chrono::seconds      max_lifetime = std::chrono::seconds{3600};
+    std::chrono::milliseconds wait_timeout = std::chrono::milliseconds{5000};
+
+    std::unique_ptr<pg_connection> acquire() {
+        auto             deadline = std::chrono::steady_clock::now() + wait_timeout;
+        std::unique_lock lock{mutex};
+        while (true) {
+            if (!idle.empty()) {
+                auto conn = std::move(idle.back());
+                idle.pop_back();
+                if (conn->is_open() && conn->created > last_failure &&
+                    std::chrono::steady_clock::now() - conn->created < max_lifetime)
+                    return conn;
+                --num_open;
+                lock.unlock();
+                conn.reset();
+                lock.lock();
+                continue;
+            }
+            if (num_open < max_size) {
+                ++num_open;
+                lock.unlock();
+                try {
+                    return std::make_unique<pg_connection>(binary);
+                } catch (...) {
+                    lock.lock();
+                    --num_open;
+                    cv.notify_one();
+                    throw;
+                }
+            }
+            if (cv.wait_until(lock, deadline) == std::cv_status::timeout && idle.empty() && num_open >= max_size)
+                throw std::runtime_error("timed out waiting for a database connection");
+        }
+    }
+
+    // Connections which failed are dropped instead of being reused, along with every idle connection opened before them
+    void release(std::unique_ptr<pg_connection> conn, bool healthy) {
+        std::vector<std::unique_ptr<pg_connection>> stale;
+        {
+            std::lock_guard lock{mutex};
+            if (healthy) {
+                idle.push_back(std::move(conn));
+            } else {
+                --num_open;
+                last_failure = std::chrono::steady_clock::now();
+                num_open -= idle.size();
+                stale = std::move(idle);
+                idle.clear();
+            }
+        }
+        conn.reset();
+        stale.clear();
+        cv.notify_all();
+    }
+}; // pg_connection_pool
+
+static std::string fill_status_sql(const std::string& schema) {
+    return "select head, head_id, irreversible, irreversible_id, first from \"" + schema + "\".fill_status";
+}
+
+static std::string block_id_sql(const std::string& schema, uint32_t block_num) {
+    return "select block_id from \"" + schema + "\".block_info where block_num=" + pg::sql_str(false, block_num);
+}
+
+// field(i) returns column i of the fill_status row as text
+template <typename F>
+static state_history::fill_status text_to_fill_status(F field) {
+    state_history::fill_status result;
+    result.head            = std::stoul(field(0));
+    result.head_id         = pg::sql_to_checksum256(field(1));
+    result.irreversible    = std::stoul(field(2));
+    result.irreversible_id = pg::sql_to_checksum256(field(3));
+    result.first           = std::stoul(field(4));
+    return result;
+}
+
+static state_history::fill_status read_fill_status(pqxx::connection& c, const std::string& schema) {
+    pqxx::work t(c);
+    auto       row = t.exec(fill_status_sql(schema))[0];
+    return text_to_fill_status([&](int col) { return row[col].c_str(); });
+}
+
+// Runs a query with text results on a libpq connection
+static pg::pg_result_ptr exec_raw(PGconn* raw, const std::string& sql) {
+    pg::pg_result_ptr r{PQexec(raw, sql.c_str())};
+    if (PQresultStatus(r.get()) == PGRES_TUPLES_OK)
+        return r;
+    std::string msg = r ? PQresultErrorMessage(r.get()) : PQerrorMessage(raw);
+    if (PQstatus(raw) != CONNECTION_OK)
+        throw pqxx::broken_connection(msg);
+    throw std::runtime_error(msg);
+}
+
+// fill_status as of fill-pg's last notification (see pg::fill_status_channel), or of the last poll for fillers which don't
+// send one. Sessions start from it instead of querying fill_status. It may be a little behind; that only means answering
+// from a slightly older head, since did_fork() still checks that head's block_info.
+class fill_status_cache {
+  private:
+    std::mutex                                mutex  = {};
+    std::optional<state_history::fill_status> status = {};
+
+  public:
+    std::optional<state_history::fill_status> get() {
+        std::lock_guard lock{mutex};
+        return status;
+    }
+
+    void set(const std::optional<state_history::fill_status>& s) {
+        std::lock_guard lock{mutex};
+        status = s;
+    }
+};
+
+struct fill_status_receiver : pqxx::notification_receiver {
+    fill_status_receiver(pqxx::connection& c, const std::string& channel)
+        : pqxx::notification_receiver(c, channel) {}
+
+    void operator()(const std::string&, int) override {}
+};
+
 struct pg_database_interface : database_interface, std::enable_shared_from_this<pg_database_interface> {
-    std::string                       schema = {};
-    std::unique_ptr<const pg::config> config = {};
+    std::string                       schema         = {};
+    std::unique_ptr<const pg::config> config         = {};
+    pg_connection_pool                pool           = {};
+    bool                              binary_results = false;
+    fill_status_cache                 status_cache   = {};
+    std::atomic<bool>                 stopping       = false;
+    std::thread                       listener       = {};
 
-    virtual ~pg_database_interface() {}
+    virtual ~pg_database_interface() { stop_listener(); }
 
     virtual std::unique_ptr<query_session> create_query_session();
+
+    void start_listener() {
+        listener = std::thread([this] { listen(); });
+    }
+
+    void stop_listener() {
+        stopping = true;
+        if (listener.joinable())
+            listener.join();
+    }
+
+    // Refreshes status_cache on each notification, and at least once a second
+    void listen() {
+        while (!stopping) {
+            try {
+                pqxx::connection     c;
+                fill_status_receiver receiver(c, pg::fill_status_channel(schema));
+                while (!stopping) {
+                    status_cache.set(read_fill_status(c, schema));
+                    c.await_notification(1, 0);
+                }
+            } catch (const std::exception& e) {
+                status_cache.set({});
+                elog("fill_status listener: ${e}", ("e", e.what()));
+                std::this_thread::sleep_for(1s);
+            }
+        }
+    }
 };
 
 struct pg_query_session : query_session {
-    virtual ~pg_query_session() {}
+    std::shared_ptr<pg_database_interface> db_iface = {};
+    std::unique_ptr<pg_connection>         conn     = {};
 
-    std::shared_ptr<pg_database_interface> db_iface;
-    pqxx::connection                       sql_connection = {};
+    pg_query_session(std::shared_ptr<pg_database_interface> db_iface)
+        : db_iface(std::move(db_iface))
+        , conn(this->db_iface->pool.acquire()) {}
+
+    virtual ~pg_query_session() {
+        if (conn) {
+            bool healthy = conn->is_open();
+            db_iface->pool.release(std::move(conn), healthy);
+        }
+    }
+
+    // A connection may have been broken (e.g. by a server restart) while it sat in the pool.
+    // Replace it and try once more; release() makes sure the replacement is a new connection.
+    template <typename F>
+    auto with_connection(F f) {
+        try {
+            return f(*conn);
+        } catch (const pqxx::broken_connection&) {
+            ilog("reconnecting to database");
+            db_iface->pool.release(std::move(conn), false);
+            conn = db_iface->pool.acquire();
+            return f(*conn);
+        }
+    }
 
     virtual state_history::fill_status get_fill_status() override {
-        pqxx::work t(sql_connection);
-        auto row = t.exec("select head, head_id, irreversible, irreversible_id, first from \"" + db_iface->schema + "\".fill_status")[0];
-
-        state_history::fill_status result;
-        result.head            = row[0].as<uint32_t>();
-        result.head_id         = pg::sql_to_checksum256(row[1].c_str());
-        result.irreversible    = row[2].as<uint32_t>();
-        result.irreversible_id = pg::sql_to_checksum256(row[3].c_str());
-        result.first           = row[4].as<uint32_t>();
-        return result;
+        if (auto status = db_iface->status_cache.get())
+            return *status;
+        return with_connection([&](pg_connection& c) {
+            if (c.sql_connection)
+                return read_fill_status(*c.sql_connection, db_iface->schema);
+            auto r = exec_raw(c.raw.get(), fill_status_sql(db_iface->schema));
+            if (!PQntuples(r.get()))
+                throw std::runtime_error("fill_status is empty");
+            return text_to_fill_status([&](int col) { return PQgetvalue(r.get(), 0, col); });
+        });
     }
 
+    // A block which doesn't match the cached head means a fork; the cache is dropped so retries read fill_status until the
+    // listener catches up
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) override {
-        pqxx::work t(sql_connection);
-        auto       result =
-            t.exec("select block_id from \"" + db_iface->schema + "\".block_info where block_num=" + pg::sql_str(false, block_num));
-        if (result.empty())
-            return {};
-        return pg::sql_to_checksum256(result[0][0].c_str());
+        auto id     = read_block_id(block_num);
+        auto cached = db_iface->status_cache.get();
+        if (cached && cached->head == block_num && (!id || id->value != cached->head_id.value))
+            db_iface->status_cache.set({});
+        return id;
     }
 
-    virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
-        abieos::name query_name;
-        abieos::bin_to_native(query_name, query_bin);
+    std::optional<abieos::checksum256> read_block_id(uint32_t block_num) {
+        return with_connection([&](pg_connection& c) -> std::optional<abieos::checksum256> {
+            if (!c.sql_connection) {
+                auto r = exec_raw(c.raw.get(), block_id_sql(db_iface->schema, block_num));
+                if (!PQntuples(r.get()))
+                    return {};
+                return pg::sql_to_checksum256(PQgetvalue(r.get(), 0, 0));
+            }
+            pqxx::work t(*c.sql_connection);
+            auto       result = t.exec(block_id_sql(db_iface->schema, block_num));
+            if (result.empty())
+                return {};
+            return pg::sql_to_checksum256(result[0][0].c_str());
+        });
+    }
 
-        // todo: check for false positives in secondary indexes
-        auto it = db_iface->config->query_map.find(query_name);
-        if (it == db_iface->config->query_map.end())
-            throw std::runtime_error("query_database: unknown query: " + (std::string)query_name);
-        const pg::query& query = *it->second;
+    virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
+        // query_bin is captured by value; a retry decodes the request again from the start
+        return with_connection([this, query_bin, head](pg_connection& c) { return exec_query(c, query_bin, head); });
+    }
 
-        uint32_t snapshot_block_num = 0;
-        if (query.has_block_snapshot)
-            snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
-        std::string query_str = "select * from \"" + db_iface->schema + "\"." + query.function + "(";
-        bool        need_sep  = false;
-        if (query.has_block_snapshot) {
-            query_str += pg::sql_str(false, snapshot_block_num);
-            need_sep = true;
-        }
+    // Every query already runs in a transaction of its own, so a shared session is just another connection. The requester's
+    // did_fork() check comes after the shared session's reads, so it catches a fork between them.
+    virtual std::unique_ptr<query_session> share() override { return std::make_unique<pg_query_session>(db_iface); }
 
-        auto add_args = [&](auto& args) {
-            for (auto& arg : args) {
-                if (need_sep)
-                    query_str += pg::sep(false);
-                query_str += arg.bin_to_sql(sql_connection, false, query_bin);
-                need_sep = true;
-            }
-        };
-        add_args(query.arg_types);
-        add_args(query.index_obj->range_types);
-        add_args(query.index_obj->range_types);
+    static size_t num_params(const pg::query& query) {
+        return query.has_block_snapshot + query.arg_types.size() + 2 * query.index_obj->range_types.size() + query.has_position_index +
+               1;
+    }
 
-        if (query.has_position_index) {
-            int32_t from_position = 0;
-            from_position = abieos::bin_to_native<int32_t>(query_bin);
-            query_str += pg::sep(false) + pg::sql_str(false, from_position);
-            need_sep = true;
-        }
-        
-        auto max_results = abieos::read_raw<uint32_t>(query_bin);
-        query_str += pg::sep(false) + pg::sql_str(false, std::min(max_results, query.max_results));
-        query_str += ")";
+    static std::string query_sql(const std::string& schema, const pg::query& query) {
+        std::string sql = "select * from \"" + schema + "\"." + query.function + "(";
+        for (size_t i = 1; i <= num_params(query); ++i)
+            sql += (i > 1 ? "," : "") + ("$" + std::to_string(i));
+        sql += ")";
+        return sql;
+    }
 
-        pqxx::work        t(sql_connection);
-        auto              exec_result = t.exec(query_str);
+    // Converts the result rows into the layout the query WASMs expect. append(row, column, bin) converts one
+    // field; is_present(row, column) reads a begin_optional flag.
+    template <typename Append, typename IsPresent>
+    static std::vector<char> rows_to_bin(const pg::query& query, size_t num_rows, Append append, IsPresent is_present) {
         std::vector<char> result;
         std::vector<char> row_bin;
-        abieos::push_varuint32(result, exec_result.size());
-        for (const auto& r : exec_result) {
+        abieos::push_varuint32(result, num_rows);
+        for (size_t row = 0; row < num_rows; ++row) {
             row_bin.clear();
             int i = 0;
             for (size_t field_index = 0; field_index < query.result_fields.size();) {
                 auto& field = query.result_fields[field_index++];
-                field.type_obj->sql_to_bin(row_bin, r[i++]);
-                if (field.begin_optional && !r[i - 1].as<bool>()) {
+                append(row, i++, *field.type_obj, row_bin);
+                if (field.begin_optional && !is_present(row, i - 1)) {
                     while (field_index < query.result_fields.size()) {
                         ++field_index;
                         ++i;
@@ -116,17 +332,131 @@ struct pg_query_session : query_session {
             abieos::push_varuint32(result, row_bin.size());
             result.insert(result.end(), row_bin.begin(), row_bin.end());
         }
-        t.commit();
         if ((uint32_t)result.size() != result.size())
             throw std::runtime_error("query_database: result is too big");
         return result;
     }
+
+    std::vector<char> exec_query(pg_connection& c, abieos::input_buffer query_bin, uint32_t head) {
+        abieos::name query_name;
+        abieos::bin_to_native(query_name, query_bin);
+
+        // todo: check for false positives in secondary indexes
+        auto it = db_iface->config->query_map.find(query_name);
+        if (it == db_iface->config->query_map.end())
+            throw std::runtime_error("query_database: unknown query: " + (std::string)query_name);
+        const pg::query& query = *it->second;
+
+        // parameters are in binary format; nullopt is null
+        std::vector<std::optional<std::string>> params;
+        std::string                             param;
+        auto                                    add_param = [&](bool present) {
+            if (present)
+                params.emplace_back(std::move(param));
+            else
+                params.emplace_back();
+            param.clear();
+        };
+
+        if (query.has_block_snapshot) {
+            auto snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
+            add_param(pg::native_to_param(param, snapshot_block_num));
+        }
+
+        auto add_args = [&](auto& args) {
+            for (auto& arg : args)
+                add_param(arg.bin_to_param(param, query_bin));
+        };
+        add_args(query.arg_types);
+        add_args(query.index_obj->range_types);
+        add_args(query.index_obj->range_types);
+
+        if (query.has_position_index)
+            add_param(pg::native_to_param(param, abieos::bin_to_native<int32_t>(query_bin)));
+
+        auto max_results = abieos::read_raw<uint32_t>(query_bin);
+        add_param(pg::native_to_param(param, (int32_t)std::min(max_results, query.max_results)));
+
+        if (db_iface->binary_results)
+            return exec_binary(c, query, params);
+        else
+            return exec_text(c, query, params);
+    }
+
+    // Each query function is prepared once per connection
+    std::vector<char> exec_text(pg_connection& c, const pg::query& query, const std::vector<std::optional<std::string>>& params) {
+        auto name = (std::string)query.short_name;
+        if (c.prepared.insert(query.short_name).second)
+            c.sql_connection->prepare(name, query_sql(db_iface->schema, query));
+
+        std::vector<std::optional<pqxx::binarystring>> bin_params;
+        for (auto& p : params) {
+            if (p)
+                bin_params.emplace_back(*p);
+            else
+                bin_params.emplace_back();
+        }
+
+        pqxx::work t(*c.sql_connection);
+        auto       exec_result = t.exec_prepared(name, pqxx::prepare::make_dynamic_params(bin_params));
+        auto       result      = rows_to_bin(
+            query, exec_result.size(),
+            [&](size_t row, int col, const pg::type& type, std::vector<char>& bin) { type.sql_to_bin(bin, exec_result[row][col]); },
+            [&](size_t row, int col) { return exec_result[row][col].as<bool>(); });
+        t.commit();
+        return result;
+    }
+
+    // libpqxx only requests text results, so this path talks to libpq directly. Fields are decoded
+    // from PostgreSQL's binary format by pg::type::result_to_bin.
+    std::vector<char> exec_binary(pg_connection& c, const pg::query& query, const std::vector<std::optional<std::string>>& params) {
+        auto* raw   = c.raw.get();
+        auto  check = [&](const pg::pg_result_ptr& r, ExecStatusType expected) {
+            if (PQresultStatus(r.get()) == expected)
+                return;
+            std::string msg = r ? PQresultErrorMessage(r.get()) : PQerrorMessage(raw);
+            if (PQstatus(raw) != CONNECTION_OK)
+                throw pqxx::broken_connection(msg);
+            throw std::runtime_error("query_database: " + msg);
+        };
+
+        auto name = (std::string)query.short_name;
+        if (!c.prepared.count(query.short_name)) {
+            pg::pg_result_ptr r{PQprepare(raw, name.c_str(), query_sql(db_iface->schema, query).c_str(), params.size(), nullptr)};
+            check(r, PGRES_COMMAND_OK);
+            c.prepared.insert(query.short_name);
+        }
+
+        std::vector<const char*> values;
+        std::vector<int>         lengths;
+        std::vector<int>         formats(params.size(), 1);
+        for (auto& p : params) {
+            values.push_back(p ? p->data() : nullptr);
+            lengths.push_back(p ? p->size() : 0);
+        }
+        pg::pg_result_ptr r{PQexecPrepared(raw, name.c_str(), params.size(), values.data(), lengths.data(), formats.data(), 1)};
+        check(r, PGRES_TUPLES_OK);
+
+        auto field = [&](size_t row, int col) -> std::pair<const char*, int> {
+            if (PQgetisnull(r.get(), row, col))
+                return {nullptr, 0};
+            return {PQgetvalue(r.get(), row, col), PQgetlength(r.get(), row, col)};
+        };
+        return rows_to_bin(
+            query, PQntuples(r.get()),
+            [&](size_t row, int col, const pg::type& type, std::vector<char>& bin) {
+                auto [data, len] = field(row, col);
+                type.result_to_bin(bin, data, len);
+            },
+            [&](size_t row, int col) {
+                auto [data, len] = field(row, col);
+                return data && len == 1 && data[0];
+            });
+    }
 }; // pg_query_session
 
 std::unique_ptr<query_session> pg_database_interface::create_query_session() {
-    auto session      = std::make_unique<pg_query_session>();
-    session->db_iface = shared_from_this();
-    return session;
+    return std::make_unique<pg_query_session>(shared_from_this());
 }
 
 struct wasm_ql_pg_plugin_impl {
@@ -138,12 +468,28 @@ wasm_ql_pg_plugin::wasm_ql_pg_plugin()
 
 wasm_ql_pg_plugin::~wasm_ql_pg_plugin() {}
 
-void wasm_ql_pg_plugin::set_program_options(options_description& cli, options_description& cfg) {}
+void wasm_ql_pg_plugin::set_program_options(options_description& cli, options_description& cfg) {
+    auto op = cfg.add_options();
+    op("wpg-pool-size", bpo::value<uint32_t>(), "Maximum number of database connections (default: wql-exec-threads)");
+    op("wpg-max-lifetime", bpo::value<uint32_t>()->default_value(3600), "Reconnect database connections older than this many seconds");
+    op("wpg-pool-timeout", bpo::value<uint32_t>()->default_value(5000),
+       "Fail a request if no database connection becomes available within this many milliseconds");
+    op("wpg-binary-results", "Fetch query results in PostgreSQL's binary format");
+}
 
 void wasm_ql_pg_plugin::plugin_initialize(const variables_map& options) {
     try {
         my->interface         = std::make_shared<pg_database_interface>();
         my->interface->schema = options["pg-schema"].as<std::string>();
+        auto& pool            = my->interface->pool;
+        pool.max_size         = options.count("wpg-pool-size") ? options["wpg-pool-size"].as<uint32_t>()
+                                                              : (uint32_t)options["wql-exec-threads"].as<int>();
+        pool.max_lifetime     = std::chrono::seconds{options["wpg-max-lifetime"].as<uint32_t>()};
+        pool.wait_timeout     = std::chrono::milliseconds{options["wpg-pool-timeout"].as<uint32_t>()};
+        if (!pool.max_size)
+            throw std::runtime_error("--wpg-pool-size must be at least 1");
+        my->interface->binary_results = options.count("wpg-binary-results");
+        pool.binary                   = my->interface->binary_results;
         auto x                = read_string(options["query-config"].as<std::string>().c_str());
         auto config           = std::make_unique<pg::config>();
         try {
@@ -158,5 +504,9 @@ void wasm_ql_pg_plugin::plugin_initialize(const variables_map& options) {
     FC_LOG_AND_RETHROW()
 }
 
-void wasm_ql_pg_plugin::plugin_startup() {}
-void wasm_ql_pg_plugin::plugin_shutdown() { ilog("wasm_ql_pg_plugin stopped"); }
+void wasm_ql_pg_plugin::plugin_startup() { my->interface->start_listener(); }
+
+void wasm_ql_pg_plugin::plugin_shutdown() {
+    my->interface->stop_listener();
+    ilog("wasm_ql_pg_plugin stopped");
+}
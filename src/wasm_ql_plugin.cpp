@@ -31,12 +31,16 @@ static abstract_plugin& _wasm_ql_plugin = app().register_plugin<wasm_ql_plugin>(
 struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
     bool                                   stopping         = false;
     int                                    num_threads      = {};
+    int                                    num_exec_threads = {};
+    uint32_t                               max_queued       = {};
     std::string                            endpoint_address = {};
     std::string                            endpoint_port    = {};
     std::shared_ptr<wasm_ql::shared_state> state            = {};
     std::shared_ptr<wasm_ql::http_server>  http_server      = {};
 
-    void start_http() { http_server = wasm_ql::http_server::create(num_threads, state, endpoint_address, endpoint_port); }
+    void start_http() {
+        http_server = wasm_ql::http_server::create(num_threads, num_exec_threads, max_queued, state, endpoint_address, endpoint_port);
+    }
 
     void shutdown() {
         stopping = true;
@@ -55,12 +59,18 @@ wasm_ql_plugin::~wasm_ql_plugin() {
 
 void wasm_ql_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto op = cfg.add_options();
-    op("wql-threads", bpo::value<int>()->default_value(8), "Number of threads to process requests");
+    op("wql-threads", bpo::value<int>()->default_value(8), "Number of threads handling HTTP connections");
+    op("wql-exec-threads", bpo::value<int>()->default_value(8), "Number of threads executing queries");
+    op("wql-max-queued", bpo::value<uint32_t>()->default_value(64),
+       "Maximum number of queries waiting for an execution thread, at least 1; beyond this, queries get 503");
     op("wql-listen", bpo::value<std::string>()->default_value("127.0.0.1:8880"), "Endpoint to listen on");
     op("wql-allow-origin", bpo::value<std::string>(), "Access-Control-Allow-Origin header. Use \"*\" to allow any.");
     op("wql-wasm-dir", bpo::value<std::string>()->default_value("."), "Directory to fetch WASMs from");
     op("wql-static-dir", bpo::value<std::string>(), "Directory to serve static files from (default: disabled)");
     op("wql-console", "Show console output");
+    op("wql-cache-mb", bpo::value<uint32_t>()->default_value(64),
+       "Size of the cache of replies to identical requests at the same head block, in MiB. 0 disables.");
+    op("wql-vm", bpo::value<std::string>()->default_value("interpreter"), "WASM execution mode: interpreter or jit (x86_64 only)");
 }
 
 void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
@@ -68,18 +78,34 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
         auto ip_port = options.at("wql-listen").as<std::string>();
         if (ip_port.find(':') == std::string::npos)
             throw std::runtime_error("invalid --wql-listen value: " + ip_port);
+        if (!options.at("wql-max-queued").as<uint32_t>())
+            throw std::runtime_error("--wql-max-queued must be at least 1");
 
         my->state            = std::make_shared<wasm_ql::shared_state>();
         my->state->console   = options.count("wql-console");
         my->num_threads      = options.at("wql-threads").as<int>();
+        my->num_exec_threads = options.at("wql-exec-threads").as<int>();
+        my->max_queued       = options.at("wql-max-queued").as<uint32_t>();
         my->endpoint_port    = ip_port.substr(ip_port.find(':') + 1, ip_port.size());
         my->endpoint_address = ip_port.substr(0, ip_port.find(':'));
         my->state->wasm_dir  = options.at("wql-wasm-dir").as<std::string>();
         if (options.count("wql-allow-origin"))
             my->state->allow_origin = options.at("wql-allow-origin").as<std::string>();
+        if (auto mb = options.at("wql-cache-mb").as<uint32_t>())
+            my->state->responses = std::make_shared<wasm_ql::response_cache>(size_t(mb) * 1024 * 1024);
         if (options.count("wql-static-dir"))
             my->state->static_dir = options.at("wql-static-dir").as<std::string>();
 
+        auto vm = options.at("wql-vm").as<std::string>();
+        if (vm == "interpreter")
+            my->state->vm = vm_type::interpreter;
+#ifdef __x86_64__
+        else if (vm == "jit")
+            my->state->vm = vm_type::jit;
+#endif
+        else
+            throw std::runtime_error("invalid --wql-vm value: " + vm);
+
         register_callbacks();
     }
     FC_LOG_AND_RETHROW()
@@ -12,6 +12,10 @@ struct query_session {
     virtual state_history::fill_status         get_fill_status()                                         = 0;
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num)                          = 0;
     virtual std::vector<char>                  query_database(abieos::input_buffer query, uint32_t head) = 0;
+
+    // Opens a session for another thread which reads what this one does. Called from that thread while this session is
+    // in use, so it may only read state which doesn't change over the session's life.
+    virtual std::unique_ptr<query_session> share() = 0;
 };
 
 struct database_interface {
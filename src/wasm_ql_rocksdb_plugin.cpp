@@ -3,6 +3,7 @@
 #include "wasm_ql_rocksdb_plugin.hpp"
 #include "util.hpp"
 
+#include <algorithm>
 #include <fc/exception/exception.hpp>
 
 using namespace appbase;
@@ -11,44 +12,134 @@ namespace rdb = state_history::rdb;
 
 static abstract_plugin& _wasm_ql_rocksdb_plugin = app().register_plugin<wasm_ql_rocksdb_plugin>();
 
+// All reads in a session, including fill_status, come from one snapshot. A concurrent fill_rocksdb (combo mode) can't
+// show a session half of a block, and did_fork() always agrees with the fill_status the session started with. Iterators
+// belong to one thread; a shared session gets its own iterators on the same snapshot.
+struct rocksdb_session_state {
+    std::shared_ptr<const rdb::snapshot> snapshot;
+    state_history::fill_status           fill_status;
+    std::unique_ptr<rocksdb::Iterator>   it_for_get;
+    std::unique_ptr<rocksdb::Iterator>   it0;
+    std::unique_ptr<rocksdb::Iterator>   it1;
+    std::unique_ptr<rocksdb::Iterator>   it2;
+    std::unique_ptr<rocksdb::Iterator>   it3;
+    std::unique_ptr<rocksdb::Iterator>   it4;
+
+    rocksdb_session_state(rdb::database& database)
+        : rocksdb_session_state(std::make_shared<const rdb::snapshot>(database)) {
+
+        auto f = rdb::get<state_history::fill_status>(*it_for_get, kv::make_fill_status_key(), false);
+        if (f)
+            fill_status = *f;
+    }
+
+    // same snapshot and fill_status, new iterators
+    rocksdb_session_state(const rocksdb_session_state& src)
+        : rocksdb_session_state(src.snapshot) {
+        fill_status = src.fill_status;
+    }
+
+  private:
+    rocksdb_session_state(std::shared_ptr<const rdb::snapshot> snap)
+        : snapshot{std::move(snap)}
+        , it_for_get{snapshot->new_iterator(rdb::column::meta)}
+        , it0{snapshot->new_iterator(rdb::column::index)}
+        , it1{snapshot->new_iterator(rdb::column::index)}
+        , it2{snapshot->new_iterator(rdb::column::content)}
+        , it3{snapshot->new_iterator(rdb::column::index)}
+        , it4{snapshot->new_iterator(rdb::column::content)} {}
+};
+
 struct rocksdb_database_interface : database_interface, std::enable_shared_from_this<rocksdb_database_interface> {
-    std::shared_ptr<::rocksdb_inst> rocksdb_inst;
+    std::shared_ptr<::rocksdb_inst>                     rocksdb_inst;
+    std::mutex                                          mutex;
+    std::vector<std::unique_ptr<rocksdb_session_state>> states;
+    size_t                                              max_states = 0;
+    std::optional<rocksdb::SequenceNumber>              status_seq; // fill_status was read at this sequence number
+    std::optional<state_history::fill_status>           status;
 
     virtual ~rocksdb_database_interface() {}
 
     virtual std::unique_ptr<query_session> create_query_session();
+
+    std::unique_ptr<rocksdb_session_state> get_state() {
+        std::unique_ptr<rocksdb_session_state> state;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!states.empty()) {
+                state = std::move(states.back());
+                states.pop_back();
+            }
+        }
+        if (state) {
+            if (state->snapshot->snap->GetSequenceNumber() == rocksdb_inst->database.db->GetLatestSequenceNumber())
+                return state;
+            auto current = current_fill_status();
+            if (current && *current == state->fill_status)
+                return state;
+            std::lock_guard<std::mutex> lock{mutex};
+            drop_stale_states(current);
+        }
+        return std::make_unique<rocksdb_session_state>(rocksdb_inst->database);
+    }
+
+    // mutex must be held
+    void drop_stale_states(const std::optional<state_history::fill_status>& current) {
+        states.erase(
+            std::remove_if(
+                states.begin(), states.end(), [&](auto& state) { return !current || *current != state->fill_status; }),
+            states.end());
+    }
+
+    std::optional<state_history::fill_status> current_fill_status() {
+        auto seq = rocksdb_inst->database.db->GetLatestSequenceNumber();
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (status_seq == seq)
+                return status;
+        }
+        // a write between reading seq and this may make the result newer than seq, which is harmless: seq is no longer
+        // the latest, so it won't be looked up again
+        auto result = rdb::get<state_history::fill_status>(rocksdb_inst->database, kv::make_fill_status_key(), false);
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!status_seq || *status_seq < seq) {
+            status_seq = seq;
+            status     = result;
+        }
+        return result;
+    }
+
+    void store_state(std::unique_ptr<rocksdb_session_state> state) {
+        auto                        current = current_fill_status();
+        std::lock_guard<std::mutex> lock{mutex};
+        drop_stale_states(current);
+        if (current && *current == state->fill_status && states.size() < max_states)
+            states.push_back(std::move(state));
+    }
 };
 
 struct rocksdb_query_session : query_session {
     std::shared_ptr<rocksdb_database_interface> db_iface;
-    state_history::fill_status                  fill_status;
-    std::unique_ptr<rocksdb::Iterator>          it_for_get;
-    std::unique_ptr<rocksdb::Iterator>          it0;
-    std::unique_ptr<rocksdb::Iterator>          it1;
-    std::unique_ptr<rocksdb::Iterator>          it2;
-    std::unique_ptr<rocksdb::Iterator>          it3;
-    std::unique_ptr<rocksdb::Iterator>          it4;
+    std::unique_ptr<rocksdb_session_state>      state;
 
     rocksdb_query_session(const std::shared_ptr<rocksdb_database_interface>& db_iface)
         : db_iface(db_iface)
-        , it_for_get{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it0{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it1{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it2{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it3{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it4{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())} {
+        , state(db_iface->get_state()) {}
 
-        auto f = rdb::get<state_history::fill_status>(*it_for_get, kv::make_fill_status_key(), false);
-        if (f)
-            fill_status = *f;
-    }
+    rocksdb_query_session(const std::shared_ptr<rocksdb_database_interface>& db_iface, std::unique_ptr<rocksdb_session_state> state)
+        : db_iface(db_iface)
+        , state(std::move(state)) {}
+
+    virtual ~rocksdb_query_session() { db_iface->store_state(std::move(state)); }
 
-    virtual ~rocksdb_query_session() {}
+    virtual std::unique_ptr<query_session> share() override {
+        return std::make_unique<rocksdb_query_session>(db_iface, std::make_unique<rocksdb_session_state>(*state));
+    }
 
-    virtual state_history::fill_status get_fill_status() override { return fill_status; }
+    virtual state_history::fill_status get_fill_status() override { return state->fill_status; }
 
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) override {
-        auto rb = rdb::get<kv::received_block>(*it_for_get, kv::make_received_block_key(block_num), false);
+        auto rb = rdb::get<kv::received_block>(*state->it_for_get, kv::make_received_block_key(block_num), false);
         if (rb)
             return rb->block_id;
         return {};
@@ -104,15 +195,19 @@ struct rocksdb_query_session : query_session {
 
         std::vector<std::vector<char>> rows;
         uint32_t                       num_results = 0;
-        rdb::for_each_subkey(*it0, first, last, [&](const auto& index_key, auto, auto) {
+        rdb::for_each_subkey(*state->it0, first, last, [&](const auto& index_key, auto, auto) {
             std::vector index_key_limit_block = index_key;
             if (query.table_obj->is_delta)
                 kv::append_index_suffix(index_key_limit_block, snapshot_block_num);
             // todo: unify rdb's and pg's handling of negative result because of snapshot_block_num
-            rdb::for_each(*it1, index_key_limit_block, index_key, [&](auto index_value, auto) {
-                auto delta_value =
-                    *rdb::get_raw(*it2, extract_pk_from_index(index_value, *query.table_obj, query.index_obj->sort_keys), true);
+            bool pushed = false;
+            rdb::for_each(*state->it1, index_key_limit_block, index_key, [&](auto index_value, auto) {
+                auto found = rdb::get_indexed_row(*state->it2, index_value, *query.table_obj, *query.index_obj);
+                if (!found)
+                    return true;
+                auto delta_value = *found;
                 rows.emplace_back(delta_value.pos, delta_value.end);
+                pushed = true;
                 if (query.join_table) {
                     auto join_key = kv::make_index_key(query.join_table->short_name, query.join_query_short_name);
                     std::vector<std::optional<uint32_t>> table_positions;
@@ -125,11 +220,13 @@ struct rocksdb_query_session : query_session {
                         if (query.join_query->table_obj->is_delta)
                             kv::append_index_suffix(join_key_limit_block, snapshot_block_num);
                         auto& row = rows.back();
-                        rdb::for_each(*it3, join_key_limit_block, join_key, [&](auto join_index_value, auto) {
+                        rdb::for_each(*state->it3, join_key_limit_block, join_key, [&](auto join_index_value, auto) {
+                            auto join_row = rdb::get_indexed_row(
+                                *state->it4, join_index_value, *query.join_table, *query.join_query->index_obj);
+                            if (!join_row)
+                                return true;
                             found_join            = true;
-                            auto join_delta_value = *rdb::get_raw(
-                                *it4, extract_pk_from_index(join_index_value, *query.join_table, query.join_query->index_obj->sort_keys),
-                                true);
+                            auto join_delta_value = *join_row;
                             std::vector<std::optional<uint32_t>> join_positions;
                             kv::init_positions(join_positions, query.join_table->fields.size());
                             fill_positions(join_delta_value, query.join_table->fields, join_positions);
@@ -143,7 +240,10 @@ struct rocksdb_query_session : query_session {
                 }
                 return false;
             });
-            return ++num_results < max_results;
+            // an index key whose entries were all skipped as stale doesn't count against max_results
+            if (pushed)
+                ++num_results;
+            return num_results < max_results;
         });
 
         auto result = abieos::native_to_bin(rows);
@@ -174,6 +274,7 @@ void wasm_ql_rocksdb_plugin::plugin_initialize(const variables_map& options) {
         if (!my->interface) {
             my->interface               = std::make_shared<rocksdb_database_interface>();
             my->interface->rocksdb_inst = app().find_plugin<rocksdb_plugin>()->get_rocksdb_inst(true);
+            my->interface->max_states   = options["wql-exec-threads"].as<int>();
         }
         app().find_plugin<wasm_ql_plugin>()->set_database(my->interface);
     }